@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#include "AutomattesCensus.hpp"
+
+namespace HA_HDK {
+
+namespace {
+    template<typename T>
+    void atomicAdd(std::atomic<T> & target, const T value)
+    {
+        T current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value,
+            std::memory_order_relaxed));
+    }
+
+    template<typename T>
+    void atomicMin(std::atomic<T> & target, const T value)
+    {
+        T current = target.load(std::memory_order_relaxed);
+        while (value < current && !target.compare_exchange_weak(current, value,
+            std::memory_order_relaxed));
+    }
+
+    template<typename T>
+    void atomicMax(std::atomic<T> & target, const T value)
+    {
+        T current = target.load(std::memory_order_relaxed);
+        while (value > current && !target.compare_exchange_weak(current, value,
+            std::memory_order_relaxed));
+    }
+
+    bool endsWith(const std::string & name, const std::string & suffix)
+    {
+        return name.size() >= suffix.size() && \
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+}
+
+CoverageCensus::CoverageCensus(const std::string & filename)
+    : myFilename(filename)
+    , myResX(0)
+    , myResY(0)
+{
+}
+
+CoverageCensus::~CoverageCensus()
+{
+    if (endsWith(myFilename, ".json"))
+        writeJSON();
+    else
+        writeCSV();
+    std::cout << "Automattes: census of " << myTable.size() << " visible ids saved to "
+        << myFilename << "\n";
+
+    CensusTable::iterator it = myTable.begin();
+    for (; it != myTable.end(); ++it)
+        delete it->second;
+}
+
+void CoverageCensus::setImageSize(const int x, const int y) noexcept
+{
+    myResX.store(x, std::memory_order_relaxed);
+    myResY.store(y, std::memory_order_relaxed);
+}
+
+void CoverageCensus::push(const CensusBucket & bucket)
+{
+    std::unordered_map<uint32_t, CensusEntry>::const_iterator it = bucket.ids.begin();
+    for (; it != bucket.ids.end(); ++it) {
+        const CensusEntry & local = it->second;
+        CensusTable::iterator jt = myTable.find(it->first);
+        if (jt == myTable.end()) {
+            AtomicEntry * entry = new AtomicEntry;
+            std::pair<CensusTable::iterator, bool> inserted = \
+                myTable.insert(std::make_pair(it->first, entry));
+            if (!inserted.second)
+                delete entry; // another thread was first
+            jt = inserted.first;
+        }
+        AtomicEntry & entry = *jt->second;
+        atomicAdd(entry.coverage, local.coverage);
+        atomicMax(entry.maxcoverage, local.maxcoverage);
+        entry.pixels.fetch_add(local.pixels, std::memory_order_relaxed);
+        const int origin[2] = {bucket.x, bucket.y};
+        for (int k = 0; k < 2; ++k) {
+            atomicMin(entry.bbox[k],   origin[k] + local.bbox[k]);
+            atomicMax(entry.bbox[k+2], origin[k] + local.bbox[k+2]);
+        }
+    }
+}
+
+CoverageCensus::SortedEntries CoverageCensus::sortedEntries() const
+{
+    // most visible first, so culling candidates end up at the bottom.
+    SortedEntries sorted(myTable.begin(), myTable.end());
+    std::sort(sorted.begin(), sorted.end(),
+        [](const SortedEntries::value_type & a, const SortedEntries::value_type & b) {
+        const double ca = a.second->coverage.load(), cb = b.second->coverage.load();
+        return (ca != cb) ? ca > cb : a.first < b.first;
+    });
+    return sorted;
+}
+
+void CoverageCensus::writeJSON() const
+{
+    std::FILE * file = std::fopen(myFilename.c_str(), "w");
+    if (!file) {
+        std::cerr << "Automattes: can't open census file: " << myFilename << "\n";
+        return;
+    }
+    const SortedEntries sorted = sortedEntries();
+
+    const double frame = std::max(1.0, double(myResX.load()) * myResY.load());
+    std::fprintf(file, "{\"resolution\": [%d, %d],\n \"ids\": [", myResX.load(), myResY.load());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const AtomicEntry & entry = *sorted[i].second;
+        std::fprintf(file, "%s\n  {\"id\": %u, \"hash\": \"%08x\", \"coverage\": %.6g, "
+            "\"frame\": %.6g, \"max\": %.6g, \"pixels\": %llu, \"bbox\": [%d, %d, %d, %d]}",
+            i ? "," : "", sorted[i].first, sorted[i].first, entry.coverage.load(),
+            entry.coverage.load() / frame, entry.maxcoverage.load(),
+            static_cast<unsigned long long>(entry.pixels.load()),
+            entry.bbox[0].load(), entry.bbox[1].load(), entry.bbox[2].load(), entry.bbox[3].load());
+    }
+    std::fprintf(file, "\n ]\n}\n");
+    std::fclose(file);
+}
+
+void CoverageCensus::writeCSV() const
+{
+    std::FILE * file = std::fopen(myFilename.c_str(), "w");
+    if (!file) {
+        std::cerr << "Automattes: can't open census file: " << myFilename << "\n";
+        return;
+    }
+    const SortedEntries sorted = sortedEntries();
+
+    const double frame = std::max(1.0, double(myResX.load()) * myResY.load());
+    std::fprintf(file, "id,hash,coverage,frame,max,pixels,xmin,ymin,xmax,ymax\n");
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const AtomicEntry & entry = *sorted[i].second;
+        std::fprintf(file, "%u,%08x,%.6g,%.6g,%.6g,%llu,%d,%d,%d,%d\n",
+            sorted[i].first, sorted[i].first, entry.coverage.load(),
+            entry.coverage.load() / frame, entry.maxcoverage.load(),
+            static_cast<unsigned long long>(entry.pixels.load()),
+            entry.bbox[0].load(), entry.bbox[1].load(), entry.bbox[2].load(), entry.bbox[3].load());
+    }
+    std::fclose(file);
+}
+
+} // end of HA_HDK
@@ -0,0 +1,87 @@
+/*
+ Visible coverage census (filter's -c).
+
+ Per id totals of filtered coverage: summed coverage in pixels, highest
+ coverage of a single pixel, covered pixels and screen bounding box.
+ Buckets fold their ids locally and publish them once per bucket into a
+ lock free table shared by all filter threads, written at render's end as
+ JSON (file ends with .json) or CSV (anything else). Ids covering nothing
+ never show up, so the report is a list of what's actually seen on screen.
+ */
+#pragma once
+
+#ifndef __AutomattesCensus__
+#define __AutomattesCensus__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tbb/concurrent_unordered_map.h>
+
+namespace HA_HDK {
+
+struct CensusEntry
+{
+    double   coverage = 0.0;
+    float    maxcoverage = 0.f;
+    uint64_t pixels = 0;
+    int bbox[4] = {INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN};
+};
+
+// one bucket's ids, folded before they are published.
+struct CensusBucket
+{
+    int x = 0;
+    int y = 0;
+    std::unordered_map<uint32_t, CensusEntry> ids;
+
+    void add(const uint32_t id, const int px, const int py, const float coverage)
+    {
+        CensusEntry & entry = ids[id];
+        entry.coverage += coverage;
+        entry.maxcoverage = std::max(entry.maxcoverage, coverage);
+        entry.pixels += 1;
+        entry.bbox[0] = std::min(entry.bbox[0], px);
+        entry.bbox[1] = std::min(entry.bbox[1], py);
+        entry.bbox[2] = std::max(entry.bbox[2], px);
+        entry.bbox[3] = std::max(entry.bbox[3], py);
+    }
+};
+
+class CoverageCensus
+{
+public:
+    explicit CoverageCensus(const std::string & filename);
+    ~CoverageCensus();
+
+    void push(const CensusBucket & bucket);
+    void setImageSize(const int x, const int y) noexcept;
+
+private:
+    struct AtomicEntry
+    {
+        std::atomic<double>   coverage{0.0};
+        std::atomic<float>    maxcoverage{0.f};
+        std::atomic<uint64_t> pixels{0};
+        std::atomic<int> bbox[4] = {{INT32_MAX}, {INT32_MAX}, {INT32_MIN}, {INT32_MIN}};
+    };
+    // insertion and lookup are lock free, entries live until the census goes.
+    typedef tbb::concurrent_unordered_map<uint32_t, AtomicEntry*> CensusTable;
+
+    typedef std::vector<std::pair<uint32_t, const AtomicEntry*> > SortedEntries;
+    SortedEntries sortedEntries() const;
+    void writeJSON() const;
+    void writeCSV() const;
+
+    std::string myFilename;
+    CensusTable myTable;
+    std::atomic<int> myResX;
+    std::atomic<int> myResY;
+};
+
+} // end of HA_HDK Space
+
+#endif
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "AutomattesDeepWriter.hpp"
+
+namespace HA_HDK {
+
+namespace {
+    template<typename T>
+    void appendPlane(std::vector<unsigned char> & raw, const std::vector<T> & plane)
+    {
+        const size_t bytes = plane.size() * sizeof(T);
+        const size_t offset = raw.size();
+        raw.resize(offset + bytes);
+        if (bytes)
+            std::memcpy(&raw[offset], plane.data(), bytes);
+    }
+}
+
+DeepIdWriter::DeepIdWriter(const std::string & filename, const size_t capacity, 
+    const DeepIdFormat format)
+    : myFilename(filename)
+    , myFormat(format)
+    , myCapacity(std::max(capacity, (size_t)1))
+    , myResX(0)
+    , myResY(0)
+{
+    for (int i = 0; i < 4; ++i)
+        myCrop[i].store(0);
+    myFile = std::fopen(filename.c_str(), "wb");
+    if (!myFile) {
+        std::cerr << "Automattes: can't open deep id file: " << filename << "\n";
+        return;
+    }
+    writeHeader();
+    myThread = std::thread(&DeepIdWriter::run, this);
+}
+
+DeepIdWriter::~DeepIdWriter()
+{
+    if (!myFile)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(myMutex);
+        myDone = true;
+    }
+    myNotEmpty.notify_one();
+    myThread.join();
+
+    // patch resolution and bucket count now that we know them.
+    std::fseek(myFile, 0, SEEK_SET);
+    writeHeader();
+    std::fclose(myFile);
+    std::cout << "Automattes: " << myBucketCount << " deep buckets saved to "
+        << myFilename << "\n";
+}
+
+void DeepIdWriter::setImageSize(const int x, const int y) noexcept
+{
+    myResX.store(x, std::memory_order_relaxed);
+    myResY.store(y, std::memory_order_relaxed);
+}
+
+void DeepIdWriter::setFootprint(const int sppx, const int sppy, const float width, 
+    const float alpha) noexcept
+{
+    // set before render threads start filtering, written with the header on close.
+    mySamplesPerPixel[0] = sppx;
+    mySamplesPerPixel[1] = sppy;
+    myFilterWidth   = width;
+    myGaussianAlpha = alpha;
+}
+
+void DeepIdWriter::setCrop(const int * crop) noexcept
+{
+    for (int i = 0; i < 4; ++i)
+        myCrop[i].store(crop[i], std::memory_order_relaxed);
+}
+
+void DeepIdWriter::push(DeepBucket && bucket)
+{
+    if (!myFile)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(myMutex);
+        myNotFull.wait(lock, [this]{ return myQueue.size() < myCapacity; });
+        myQueue.push_back(std::move(bucket));
+    }
+    myNotEmpty.notify_one();
+}
+
+void DeepIdWriter::run()
+{
+    for (;;) {
+        DeepBucket bucket;
+        {
+            std::unique_lock<std::mutex> lock(myMutex);
+            myNotEmpty.wait(lock, [this]{ return myDone || !myQueue.empty(); });
+            if (myQueue.empty())
+                return; // done and drained
+            bucket = std::move(myQueue.front());
+            myQueue.pop_front();
+        }
+        myNotFull.notify_one();
+        write(bucket);
+    }
+}
+
+void DeepIdWriter::writeHeader()
+{
+    const int32_t res[2] = {myResX.load(), myResY.load()};
+    const bool partial = (myFormat == PARTIAL_FILE);
+    std::fwrite(partial ? PartialMagic : DeepIdMagic, 1, 4, myFile);
+    std::fwrite(partial ? &PartialVersion : &DeepIdVersion, sizeof(uint32_t), 1, myFile);
+    std::fwrite(res, sizeof(int32_t), 2, myFile);
+    std::fwrite(&myBucketCount, sizeof(uint32_t), 1, myFile);
+    if (partial) {
+        const float filter[2] = {myFilterWidth, myGaussianAlpha};
+        std::fwrite(mySamplesPerPixel, sizeof(int32_t), 2, myFile);
+        std::fwrite(filter, sizeof(float), 2, myFile);
+        const int32_t crop[4] = {myCrop[0].load(), myCrop[1].load(), myCrop[2].load(), 
+            myCrop[3].load()};
+        std::fwrite(crop, sizeof(int32_t), 4, myFile);
+    }
+}
+
+void DeepIdWriter::write(const DeepBucket & bucket)
+{
+    myRaw.clear();
+    appendPlane(myRaw, bucket.counts);
+    appendPlane(myRaw, bucket.ids);
+    appendPlane(myRaw, bucket.coverage);
+    appendPlane(myRaw, bucket.depth);
+    const bool partial = (myFormat == PARTIAL_FILE);
+    if (partial) {
+        appendPlane(myRaw, bucket.bandx);
+        appendPlane(myRaw, bucket.bandy);
+        appendPlane(myRaw, bucket.bandids);
+        appendPlane(myRaw, bucket.bandcoverage);
+        appendPlane(myRaw, bucket.bandnorm);
+    }
+
+    uLongf packedsize = compressBound(myRaw.size());
+    myPacked.resize(packedsize);
+    if (compress2(&myPacked[0], &packedsize, myRaw.data(), myRaw.size(), Z_BEST_SPEED) != Z_OK) {
+        std::cerr << "Automattes: can't compress deep bucket at "
+            << bucket.x << ", " << bucket.y << "\n";
+        return;
+    }
+
+    const int32_t  dims[4]  = {bucket.x, bucket.y, bucket.width, bucket.height};
+    const uint32_t sizes[3] = {static_cast<uint32_t>(bucket.ids.size()),
+        static_cast<uint32_t>(myRaw.size()), static_cast<uint32_t>(packedsize)};
+    const uint32_t bandsize = static_cast<uint32_t>(bucket.bandids.size());
+    std::fwrite(dims,  sizeof(int32_t),  4, myFile);
+    std::fwrite(sizes, sizeof(uint32_t), 1, myFile);
+    if (partial)
+        std::fwrite(&bandsize, sizeof(uint32_t), 1, myFile);
+    std::fwrite(sizes+1, sizeof(uint32_t), 2, myFile);
+    std::fwrite(myPacked.data(), 1, packedsize, myFile);
+    myBucketCount++;
+}
+
+} // end of HA_HDK
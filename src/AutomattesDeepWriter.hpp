@@ -0,0 +1,123 @@
+/*
+ Deep id file writer used by DEEP hash type.
+
+ Each finished bucket is handed over to a background thread which packs it
+ and appends it to a file, so render threads never wait for zlib or disk.
+ Per pixel lists of (id, coverage, depth) are stored planar, similar to
+ openexrid's deep channels [1], so any number of ranks can be extracted later.
+
+ File layout (native endianness):
+    header : char magic[4] = "ADID", uint32 version, int32 resx, int32 resy,
+             uint32 bucket count (patched on close)
+    bucket : int32 x, y, width, height, uint32 sample count,
+             uint32 raw size, uint32 packed size, packed bytes[packed size]
+    packed : zlib stream of
+             uint32 counts[width*height], uint32 ids[n], float coverage[n], float depth[n]
+
+ Partial files (filter's -b, merged by AutomattesMerge) hold a crop region
+ rendered on one node. Header adds int32 sppx, sppy, float filter width,
+ gaussian alpha, int32 crop x0, y0, x1, y1 (pixels, end exclusive). Buckets
+ store uint32 band count after sample count and their packed stream continues
+ with
+             int32 bandx[m], bandy[m], uint32 bandids[m], float bandcoverage[m], 
+             bandnorm[m]
+ Seam pixels' footprints leave the crop, so they have no list; band holds
+ node's subpixels seams of any node read, in image's subpixel coordinates.
+
+ [1] https://github.com/MercenariesEngineering/openexrid
+ */
+#pragma once
+
+#ifndef __AutomattesDeepWriter__
+#define __AutomattesDeepWriter__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace HA_HDK {
+
+static const char     DeepIdMagic[4] = {'A', 'D', 'I', 'D'};
+static const uint32_t DeepIdVersion  = 1;
+static const char     PartialMagic[4] = {'A', 'D', 'P', 'T'};
+static const uint32_t PartialVersion  = 2;
+
+enum DeepIdFormat {
+    DEEPID_FILE,
+    PARTIAL_FILE
+};
+
+// per bucket deep id data, pixels are row major starting at (x,y).
+struct DeepBucket
+{
+    int x = 0;
+    int y = 0;
+    int width  = 0;
+    int height = 0;
+    std::vector<uint32_t> counts;   // samples per pixel
+    std::vector<uint32_t> ids;
+    std::vector<float>    coverage;
+    std::vector<float>    depth;
+
+    // partial files only
+    std::vector<int32_t>  bandx;
+    std::vector<int32_t>  bandy;
+    std::vector<uint32_t> bandids;
+    std::vector<float>    bandcoverage;
+    std::vector<float>    bandnorm;
+};
+
+class DeepIdWriter
+{
+public:
+    explicit DeepIdWriter(const std::string & filename, const size_t capacity = 64, 
+        const DeepIdFormat format = DEEPID_FILE);
+    ~DeepIdWriter();
+
+    bool isOpen() const noexcept { return myFile != nullptr; }
+    // Queue bucket for writing. Only blocks when writer falls behind by capacity buckets.
+    void push(DeepBucket && bucket);
+    void setImageSize(const int x, const int y) noexcept;
+    // partial files: footprint needed to refilter seams.
+    void setFootprint(const int sppx, const int sppy, const float width, 
+        const float alpha) noexcept;
+    // partial files: node's crop in pixels (x0, y0, x1, y1), seams follow its edges.
+    void setCrop(const int * crop) noexcept;
+
+private:
+    void run();
+    void write(const DeepBucket & bucket);
+    void writeHeader();
+
+    std::FILE * myFile = nullptr;
+    std::string myFilename;
+    DeepIdFormat myFormat;
+    size_t myCapacity;
+    std::deque<DeepBucket> myQueue;
+    std::mutex myMutex;
+    std::condition_variable myNotEmpty;
+    std::condition_variable myNotFull;
+    bool myDone = false;
+    std::thread myThread;
+
+    std::atomic<int> myResX;
+    std::atomic<int> myResY;
+    uint32_t myBucketCount = 0;
+    int32_t  mySamplesPerPixel[2] = {0, 0};
+    float    myFilterWidth = 0.f;
+    float    myGaussianAlpha = 0.f;
+    std::atomic<int> myCrop[4];
+    // reused by writer thread only
+    std::vector<unsigned char> myRaw;
+    std::vector<unsigned char> myPacked;
+};
+
+} // end of HA_HDK Space
+
+#endif
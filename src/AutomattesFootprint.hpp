@@ -0,0 +1,87 @@
+/*
+ Pixel filter footprint, shared by the filter and offline tools (no HDK).
+
+ Footprint is the same for every pixel: subpixels it reads start at an
+ offset from pixel's first subpixel and are weighted by separable gaussians.
+ */
+#pragma once
+
+#ifndef __AutomattesFootprint__
+#define __AutomattesFootprint__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace HA_HDK {
+
+inline float gaussian(float d, float expv, float alpha) {
+    return std::max(0.f, float(std::exp(-alpha*d*d) - expv));
+}
+
+// Subpixels read on each side of pixel's centre (as VRAY_DemoEdgeDetectFilter).
+inline int footprintHalfWidth(const int samplesperpixel, const float width)
+{
+    if (samplesperpixel & 1)
+        return static_cast<int>(std::floor(float(samplesperpixel)*0.5f*width));
+    return static_cast<int>(std::floor(float(samplesperpixel)*0.5f*width + 0.5f));
+}
+
+// Odd footprints are centred on a subpixel, even ones fall between two.
+template<bool Odd>
+void buildFootprint(const int samplesperpixel, const int halfsamplewidth,
+    const float expv, const float alpha, int & offset, std::vector<float> & weights)
+{
+    offset = (samplesperpixel>>1) - halfsamplewidth;
+    const int size = (Odd) ? 2*halfsamplewidth + 1 : 2*halfsamplewidth;
+    weights.resize(std::max(size, 0));
+    for (int i = 0; i < size; ++i) {
+        const float x = (float(offset + i) - 0.5f*float(samplesperpixel-1)) \
+            / float(samplesperpixel);
+        // TODO: remove magic number
+        weights[i] = gaussian(x*1.66667, expv, alpha);
+    }
+}
+
+inline void buildFootprint(const int samplesperpixel, const int halfsamplewidth,
+    const float expv, const float alpha, int & offset, std::vector<float> & weights)
+{
+    if (samplesperpixel & 1)
+        buildFootprint<true>(samplesperpixel, halfsamplewidth, expv, alpha, offset, weights);
+    else
+        buildFootprint<false>(samplesperpixel, halfsamplewidth, expv, alpha, offset, weights);
+}
+
+// Crop split renders (filter's -b, AutomattesMerge): on one axis, crop holds
+// pixels [first, end) of res. Pixel is a seam if its footprint reads past the
+// crop into a neighbour's one, image's edges border no crop.
+inline bool footprintLeavesCrop(const int pixel, const int samplesperpixel, 
+    const int offset, const int size, const int first, const int end, const int res)
+{
+    const int lo = pixel*samplesperpixel + offset;
+    const int hi = lo + size - 1;
+    return (first > 0 && lo < first*samplesperpixel) \
+        || (end < res && hi >= end*samplesperpixel);
+}
+
+// True if some seam pixel of the image reads the subpixel on this axis: nodes 
+// save those for the merge to refilter seams with.
+inline bool subpixelReadBySeam(const int subpixel, const int samplesperpixel, 
+    const int offset, const int size, const int first, const int end, const int res)
+{
+    // pixels whose footprint covers the subpixel (floor division).
+    const auto floordiv = [](const int a, const int b) { 
+        return (a >= 0) ? a / b : -((-a + b - 1) / b); };
+    const int lo = std::max(floordiv(subpixel - offset - size + samplesperpixel, 
+        samplesperpixel), 0);
+    const int hi = std::min(floordiv(subpixel - offset, samplesperpixel), res - 1);
+    for (int pixel = lo; pixel <= hi; ++pixel) {
+        if (footprintLeavesCrop(pixel, samplesperpixel, offset, size, first, end, res))
+            return true;
+    }
+    return false;
+}
+
+} // end of HA_HDK Space
+
+#endif
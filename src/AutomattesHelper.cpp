@@ -4,13 +4,26 @@
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 
+#include <zlib.h>
+
 #include <UT/UT_DSOVersion.h>
 #include <UT/UT_Thread.h>
 #include <UT/UT_PointGrid.h>
 #include <tbb/concurrent_vector.h>
+#include <tbb/concurrent_hash_map.h>
 #include "AutomattesHelper.hpp"
+#include "AutomattesTrace.hpp"
+#include "MurmurHash3.h"
 
 #ifdef CONCURRENT_HASH_MAP
 #include <tbb/concurrent_hash_map.h>
@@ -18,129 +31,439 @@
 
 namespace HA_HDK {
 
-// used only for creating per thread storage
+// guards buckets' neighbours
 static std::mutex automattes_mutex;
-static std::mutex automattes_mutex2;
-// our main storage
-static VEX_Samples vexsamples;
-// 
-// static BucketGrid bucketGridX;
-// static BucketGrid bucketGridY;
-//
-static BucketCounter vexBucketCounter;
-static BucketCounter vrayBucketCounter;
-// static VEX_SampleClass vexsamplesC;
-static BucketSize bucketSize = {0,0};
-static bool bucketSizeSet = 0;
-static ut_thread_id_t mainThreadId = 0;
 static const size_t BucketQueueCapacity = 1024;
-static BucketVector bucketVector;
 
+// Session registry: filters own sessions, shaders address them by handle,
+// which indexes a fixed slot table so per sample lookups take no lock.
+static const int MaxSessions = 64;
+static std::recursive_mutex sessions_mutex;
+static std::atomic<AutomatteSession*> sessionSlots[MaxSessions];
+static std::map<std::string, std::weak_ptr<AutomatteSession> > sessionNames;
+// bumped whenever a session opens or closes, invalidates shaders' caches.
+static std::atomic<int> sessionEpoch(0);
+
+AutomatteSession::AutomatteSession(const std::string & name, const int handle)
+    : myName(name)
+    , myHandle(handle)
+    , myRegistered(0)
+    , myBucketSize({0,0})
+    , myImageSizeX(0)
+    , myImageSizeY(0)
+    , myIdTablesVersion(0)
+    , myIdSnapshotVersion(-1)
+    , myColdRawBytes(0)
+    , myColdPackedBytes(0)
+    , myScratchBuckets(0)
+    , myScratchGrown(0)
+    , myScratchBytes(0)
+    , myRankSkips(0)
+    , myPendingHead(&myPendingStub)
+    , myPendingTail(&myPendingStub)
+    , myPublished(0)
+    , myIndexed(0)
+    , myWorkerDone(false)
+{
+    myPendingStub.next.store(nullptr);
+    const CropWindow wholeimage = {0.f, 1.f, 0.f, 1.f};
+    for (int i = 0; i < 4; ++i)
+        myCrop[i].store(wholeimage[i]);
+    myBucketVector.reserve(BucketQueueCapacity*256);
+    myWorker = std::thread(&AutomatteSession::indexBuckets, this);
+}
 
-int VEX_Samples_create(const int& thread_id)
+AutomatteSession::~AutomatteSession()
 {
-    std::lock_guard<std::mutex> guard(automattes_mutex);
-    const ut_thread_id_t currentMainThreadId = UT_Thread::getMainThreadId();
+    {
+        std::lock_guard<std::mutex> guard(myWorkerMutex);
+        myWorkerDone = true;
+    }
+    myWorkerWake.notify_one();
+    myWorker.join();
+
+    const size_t rawbytes    = myColdRawBytes.load();
+    const size_t packedbytes = myColdPackedBytes.load();
+    if (packedbytes) {
+        std::cout << "Automattes: " << myName << ": cold buckets " << (rawbytes >> 10) 
+            << " KB packed to " << (packedbytes >> 10) << " KB (ratio " 
+            << static_cast<double>(rawbytes) / packedbytes << ")\n";
+    }
+    const size_t scratchbuckets = myScratchBuckets.load();
+    if (scratchbuckets) {
+        std::cout << "Automattes: " << myName << ": filter scratch grew in " 
+            << myScratchGrown.load() << " of " << scratchbuckets << " buckets (" 
+            << (myScratchBytes.load() >> 10) << " KB per thread at most)\n";
+    }
+    for (size_t plane = 0; plane < myIdCounts.size(); ++plane) {
+        if (myIdCounts[plane].empty())
+            continue;
+        const IdCountHistogram & counts = myIdCounts[plane].begin()->second;
+        const size_t most = counts.max();
+        const size_t p99  = counts.percentile(0.99);
+        std::cout << "Automattes: " << myName << ": " << myPlaneKinds[plane] 
+            << ": ids per pixel max " << most << ", 99th percentile " << p99 
+            << "; recommended ranks " << rankPlanes(p99, 2) << " (" 
+            << rankPlanes(p99, PackedPairsPerPlane) << " packed), " 
+            << rankPlanes(most, 2) << " keep every id\n";
+    }
+    if (myRankSkips.load()) {
+        std::cout << "Automattes: " << myName << ": " << myRankSkips.load() 
+            << " buckets of empty rank planes skipped\n";
+    }
+
+    std::lock_guard<std::recursive_mutex> guard(sessions_mutex);
+    sessionSlots[myHandle].store(nullptr);
+    std::map<std::string, std::weak_ptr<AutomatteSession> >::iterator it = sessionNames.find(myName);
+    if (it != sessionNames.end() && it->second.expired())
+        sessionNames.erase(it);
+    sessionEpoch++;
+
+    // Traces are one file for the whole process: the last session out writes
+    // them, once no other session's threads add to them. Registry stays 
+    // locked, so no session opens in the meantime.
+    for (int handle = 0; handle < MaxSessions; ++handle) {
+        if (sessionSlots[handle].load() != nullptr)
+            return;
+    }
+    VEX_Trace_dump();
+}
 
-    if (currentMainThreadId != mainThreadId) {
-        vexsamples.clear();
-        bucketVector.clear();
-        mainThreadId = currentMainThreadId;
+int AutomatteSession::createStore(const int& thread_id)
+{
+    #ifdef CONCURRENT_HASH_MAP
+    {
+        VEX_Samples::const_accessor ra;
+        if (mySamples.find(ra, thread_id))
+            return thread_id;
     }
+    #endif
+
+    TraceScope trace("store open");
+    std::lock_guard<std::mutex> guard(myMutex);
 
     #ifdef CONCURRENT_HASH_MAP
     VEX_Samples::const_accessor ra;
-    if (vexsamples.find(ra, thread_id))
+    if (mySamples.find(ra, thread_id))
         return thread_id;
+    ra.release();
     #else
-    VEX_Samples::const_iterator it = vexsamples.find(thread_id);
-    if(it != vexsamples.end())
+    VEX_Samples::const_iterator it = mySamples.find(thread_id);
+    if(it != mySamples.end())
         return thread_id;
     #endif
 
     BucketQueue queue;
     queue.reserve(BucketQueueCapacity);//?
-    bucketVector.reserve(BucketQueueCapacity*256);
     SampleBucket bucket;    
-    vexsamples.insert(std::pair<int, BucketQueue>(thread_id, queue));
+    mySamples.insert(std::pair<int, BucketQueue>(thread_id, queue));
     #ifdef CONCURRENT_HASH_MAP
     VEX_Samples::accessor wa;
-    vexsamples.find(wa, thread_id);
+    mySamples.find(wa, thread_id);
     wa->second.push_back(bucket);
     #else
-    vexsamples[thread_id].push_back(bucket);
+    mySamples[thread_id].push_back(bucket);
     #endif
-    //debug
-    vexBucketCounter.insert(std::pair<int, int>(thread_id, 0));
-    vrayBucketCounter.insert(std::pair<int, int>(thread_id, 0));
-
     return thread_id;
 } 
 
-int VEX_Samples_insert(const int& thread_id, const Sample& sample)
+int AutomatteSession::insert(const int& thread_id, const Sample& sample)
 {
     #ifdef CONCURRENT_HASH_MAP
     VEX_Samples::const_accessor ra;
-    const bool result = vexsamples.find(ra, thread_id);
+    const bool result = mySamples.find(ra, thread_id);
     UT_ASSERT(result);
     BucketQueue::const_iterator jt = ra->second.begin();
     #else
-    VEX_Samples::const_iterator it = vexsamples.find(thread_id);
-    UT_ASSERT(it != vexsamples.end());
-    BucketQueue::iterator jt = vexsamples[thread_id].begin();
+    VEX_Samples::const_iterator it = mySamples.find(thread_id);
+    UT_ASSERT(it != mySamples.end());
+    BucketQueue::iterator jt = mySamples[thread_id].begin();
     #endif
 
     jt->push_back(sample);
+    VEX_Trace_insert();
     const size_t size = jt->size();
-    if (size == 1) {
-        vexBucketCounter[thread_id] += 1;
-        std::cout << "VEX    thread: " << thread_id << ", bucket count:" \
-            << vexBucketCounter[thread_id] << "\n";  
-    }
     return static_cast<int>(size); //thread_id;
 }
 
-void VEX_Samples_insertBucket(const int & thread_id)
+void AutomatteSession::insertBucket(const int & thread_id)
 {
+    TraceScope trace("insert bucket");
     #ifdef CONCURRENT_HASH_MAP
     VEX_Samples::accessor wa;
-    const bool result = vexsamples.find(wa, thread_id);
+    const bool result = mySamples.find(wa, thread_id);
     UT_ASSERT(result);
     BucketQueue & bqueue = wa->second;
     #else
-    std::lock_guard<std::mutex> guard(automattes_mutex);
-    BucketQueue & bqueue = vexsamples.at(thread_id);
+    std::lock_guard<std::mutex> guard(myMutex);
+    BucketQueue & bqueue = mySamples.at(thread_id);
     #endif
     BucketQueue::iterator kt = bqueue.begin();
     SampleBucket new_bucket;
     bqueue.insert(kt, new_bucket);
 }
 
-VEX_Samples * VEX_Samples_get() 
+void AutomatteSession::countScratch(const size_t bytes, const bool grown)
 {
-    return &vexsamples;
+    myScratchBuckets++;
+    if (grown)
+        myScratchGrown++;
+    size_t largest = myScratchBytes.load();
+    while (bytes > largest && !myScratchBytes.compare_exchange_weak(largest, bytes)) {}
 }
 
-int VEX_Samples_increamentBucketCounter(const int& thread_id)
+int AutomatteSession::registerPlane(const std::string & kind)
 {
-    vrayBucketCounter[thread_id] += 1;
-    return vrayBucketCounter[thread_id];
+    std::lock_guard<std::mutex> guard(myIdCountMutex);
+    for (size_t plane = 0; plane < myPlaneKinds.size(); ++plane) {
+        if (myPlaneKinds[plane] == kind)
+            return static_cast<int>(plane);
+    }
+    myPlaneKinds.push_back(kind);
+    myIdCounts.emplace_back();
+    return static_cast<int>(myPlaneKinds.size() - 1);
 }
 
-BucketSize * VEX_getBucketSize() {
-    return &bucketSize;
+void AutomatteSession::countIds(const int plane, const int firstpair, const IdCountHistogram & counts)
+{
+    std::lock_guard<std::mutex> guard(myIdCountMutex);
+    if (plane >= 0 && plane < static_cast<int>(myIdCounts.size()))
+        myIdCounts[plane][firstpair].merge(counts);
 }
 
-void VEX_setBucketSize(int x, int y) {
-    std::lock_guard<std::mutex> guard(automattes_mutex);
-    if (bucketSize[0] != 0 || bucketSize[1] != 0) 
+void AutomatteSession::setBucketIds(const int plane, const TileKey key, const int firstpair, 
+    const int maxids)
+{
+    BucketIdTable::accessor wa;
+    const bool fresh = myBucketIds.insert(wa, PlaneBucket{plane, key});
+    if (fresh || firstpair <= wa->second.firstpair) {
+        wa->second.firstpair = firstpair;
+        wa->second.maxids    = maxids;
+    }
+}
+
+bool AutomatteSession::emptyRank(const int plane, const TileKey key, const int firstpair)
+{
+    BucketIdTable::const_accessor ra;
+    if (!myBucketIds.find(ra, PlaneBucket{plane, key}))
+        return false;
+    if (ra->second.firstpair >= firstpair || ra->second.maxids > firstpair)
+        return false;
+    myRankSkips++;
+    return true;
+}
+
+size_t AutomatteSession::registerBucket(SampleBucket & bucket)
+{
+    TraceScope trace("register");
+    size_t packedbytes = 0;
+    const size_t count = bucket.registerBucket(myBucketVector, &packedbytes);
+    // only the worker registers, so the vector's size is this bucket's end.
+    myRegistered.store(count, std::memory_order_release);
+    myColdRawBytes    += bucket.size()*sizeof(Sample);
+    myColdPackedBytes += packedbytes;
+    return count;
+}
+
+void AutomatteSession::pushPending(PendingBucket * node)
+{
+    node->next.store(nullptr, std::memory_order_relaxed);
+    PendingBucket * prev = myPendingHead.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+AutomatteSession::PendingBucket * AutomatteSession::popPending()
+{
+    PendingBucket * tail = myPendingTail;
+    PendingBucket * next = tail->next.load(std::memory_order_acquire);
+    if (tail == &myPendingStub) {
+        if (!next)
+            return nullptr;
+        myPendingTail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        myPendingTail = next;
+        return tail;
+    }
+    // producer swapped head but hasn't linked its node yet, try later.
+    if (tail != myPendingHead.load(std::memory_order_acquire))
+        return nullptr;
+    pushPending(&myPendingStub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        myPendingTail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+size_t AutomatteSession::publishBucket(SampleBucket & bucket)
+{
+    TraceScope trace("publish");
+    PendingBucket * node = new PendingBucket;
+    // filter is done with the samples, their storage travels with the node.
+    bucket.swapSamples(node->samples);
+    bucket.markRegistered();
+    pushPending(node);
+    const size_t published = myPublished.fetch_add(1, std::memory_order_release) + 1;
+    {
+        // worker checks the count under this lock before it sleeps.
+        std::lock_guard<std::mutex> guard(myWorkerMutex);
+    }
+    myWorkerWake.notify_one();
+    return published;
+}
+
+void AutomatteSession::waitIndexed()
+{
+    const size_t published = myPublished.load(std::memory_order_acquire);
+    if (myIndexed.load(std::memory_order_acquire) >= published)
+        return;
+    TraceScope trace("wait indexed");
+    std::unique_lock<std::mutex> lock(myWorkerMutex);
+    myIndexedWake.wait(lock, [&]{ 
+        return myIndexed.load(std::memory_order_acquire) >= published; });
+}
+
+void AutomatteSession::indexBuckets()
+{
+    #ifdef __linux__
+    // keep out of render threads' way.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 10);
+    #endif
+
+    for (;;) {
+        PendingBucket * node = popPending();
+        if (!node) {
+            // a published node may be half linked yet: counts tell it apart 
+            // from an empty queue, so the worker only sleeps on the latter.
+            std::unique_lock<std::mutex> lock(myWorkerMutex);
+            if (myIndexed.load() < myPublished.load()) {
+                lock.unlock();
+                std::this_thread::yield();
+                continue;
+            }
+            if (myWorkerDone)
+                return;
+            myWorkerWake.wait(lock, [&]{ 
+                return myWorkerDone || myIndexed.load() < myPublished.load(); });
+            continue;
+        }
+
+        // rows of samples next to each other pack and scan better.
+        std::sort(node->samples.begin(), node->samples.end(), 
+            [](const Sample & a, const Sample & b) { 
+                return (a.y != b.y) ? a.y < b.y : a.x < b.x; });
+        SampleBucket bucket;
+        bucket.swapSamples(node->samples);
+        delete node;
+        bucket.updateBoundingBox(0.f, 0.f, 0.01f);
+        registerBucket(bucket);
+
+        // published only after bucket is in the vector.
+        myIndexed.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> guard(myWorkerMutex);
+        }
+        myIndexedWake.notify_all();
+    }
+}
+
+void AutomatteSession::setBucketSize(int x, int y) {
+    std::lock_guard<std::mutex> guard(myMutex);
+    if (myBucketSize[0] != 0 || myBucketSize[1] != 0) 
         return;
     
-    bucketSize[0] = x;
-    bucketSize[1] = y;
+    myBucketSize[0] = x;
+    myBucketSize[1] = y;
+}
+
+ImageSize AutomatteSession::getImageSize() const {
+    const ImageSize size = {myImageSizeX.load(std::memory_order_relaxed), 
+        myImageSizeY.load(std::memory_order_relaxed)};
+    return size;
+}
+
+// set per shading sample, hence atomics instead of a lock.
+void AutomatteSession::setImageSize(int x, int y) {
+    if (myImageSizeX.load(std::memory_order_relaxed) != x)
+        myImageSizeX.store(x, std::memory_order_relaxed);
+    if (myImageSizeY.load(std::memory_order_relaxed) != y)
+        myImageSizeY.store(y, std::memory_order_relaxed);
+}
+
+CropWindow AutomatteSession::getCrop() const {
+    const CropWindow crop = {myCrop[0].load(std::memory_order_relaxed), 
+        myCrop[1].load(std::memory_order_relaxed), myCrop[2].load(std::memory_order_relaxed), 
+        myCrop[3].load(std::memory_order_relaxed)};
+    return crop;
+}
+
+// set as shaders open the session, same as image size.
+void AutomatteSession::setCrop(const CropWindow & crop) {
+    for (int i = 0; i < 4; ++i) {
+        if (myCrop[i].load(std::memory_order_relaxed) != crop[i])
+            myCrop[i].store(crop[i], std::memory_order_relaxed);
+    }
 }
 
-int VEX_bucketSizeSet() { return bucketSizeSet; }
+AutomatteSessionPtr VEX_Session_acquire(const char * name)
+{
+    std::lock_guard<std::recursive_mutex> guard(sessions_mutex);
+    AutomatteSessionPtr session = sessionNames[name].lock();
+    if (session)
+        return session;
+
+    for (int handle = 0; handle < MaxSessions; ++handle) {
+        if (sessionSlots[handle].load() != nullptr)
+            continue;
+        session = std::make_shared<AutomatteSession>(name, handle);
+        sessionSlots[handle].store(session.get());
+        sessionNames[name] = session;
+        sessionEpoch++;
+        return session;
+    }
+
+    std::cerr << "Automattes: too many concurrent sessions, can't open: " << name << "\n";
+    return session;
+}
+
+int VEX_Session_find(const char * name)
+{
+    // shaders open the store for every sample, so remember last answer per thread.
+    thread_local int cachedEpoch = -1;
+    thread_local int cachedHandle = -1;
+    thread_local std::string cachedName;
+    const int epoch = sessionEpoch.load();
+    if (epoch == cachedEpoch && cachedName.compare(name) == 0)
+        return cachedHandle;
+
+    std::lock_guard<std::recursive_mutex> guard(sessions_mutex);
+    cachedHandle = -1;
+    std::map<std::string, std::weak_ptr<AutomatteSession> >::const_iterator it = sessionNames.find(name);
+    if (it != sessionNames.end()) {
+        AutomatteSessionPtr session = it->second.lock();
+        if (session)
+            cachedHandle = session->getHandle();
+    }
+    cachedEpoch = epoch;
+    cachedName  = name;
+    return cachedHandle;
+}
+
+int VEX_Session_epoch()
+{
+    return sessionEpoch.load();
+}
+
+AutomatteSession * VEX_Session_get(const int handle)
+{
+    if (handle < 0 || handle >= MaxSessions)
+        return nullptr;
+    return sessionSlots[handle].load(std::memory_order_acquire);
+}
 
 const Sample & SampleBucket::at(const int & index) const 
 {
@@ -191,8 +514,8 @@ void SampleBucket::updateBoundingBox(const float & expx, const float & expy, con
     UT_Vector3 bucket_min = { FLT_MAX,  FLT_MAX,  FLT_MAX};
     UT_Vector3 bucket_max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
     for(int i=0; i < size; ++i) {
-        const Sample sample = mySamples.at(i);
-        const UT_Vector3 position = {sample[0], sample[1], 0.f};
+        const Sample & sample = mySamples.at(i);
+        const UT_Vector3 position = {sample.x, sample.y, 0.f};
         bucket_min = SYSmin(bucket_min, position);
         bucket_max = SYSmax(bucket_max, position);
     }
@@ -200,12 +523,74 @@ void SampleBucket::updateBoundingBox(const float & expx, const float & expy, con
     myBbox.expandBounds(expx, expy, expz);
 }
 
-size_t SampleBucket::registerBucket() 
+size_t SampleBucket::pack(const SampleBucketV & samples)
+{
+    const size_t count = samples.size();
+    const size_t bytes = count*sizeof(Sample);
+    const unsigned char * raw = reinterpret_cast<const unsigned char*>(samples.data());
+    std::vector<unsigned char> shuffled(bytes);
+    for (size_t b=0; b < sizeof(Sample); ++b) {
+        unsigned char * plane = &shuffled[b*count];
+        for (size_t i=0; i < count; ++i)
+            plane[i] = raw[i*sizeof(Sample) + b];
+    }
+
+    uLongf packedsize = compressBound(bytes);
+    myPacked.resize(packedsize);
+    if (count == 0 || compress2(&myPacked[0], &packedsize, shuffled.data(), 
+        bytes, Z_BEST_SPEED) != Z_OK) {
+        // keep it raw, still correct just bigger.
+        std::vector<unsigned char>().swap(myPacked);
+        myPackedCount = 0;
+        mySamples = samples;
+        return bytes;
+    }
+    myPacked.resize(packedsize);
+    myPacked.shrink_to_fit();
+    myPackedCount = count;
+    SampleBucketV().swap(mySamples);
+    return packedsize;
+}
+
+void SampleBucket::unpack(SampleBucketV & samples) const
+{
+    samples.clear();
+    if (!myPackedCount) {
+        samples = mySamples;
+        return;
+    }
+    const size_t count = myPackedCount;
+    uLongf bytes = count*sizeof(Sample);
+    thread_local std::vector<unsigned char> shuffled;
+    shuffled.resize(bytes);
+    if (uncompress(&shuffled[0], &bytes, myPacked.data(), myPacked.size()) != Z_OK \
+        || bytes != count*sizeof(Sample)) {
+        std::cerr << "Automattes: can't unpack cold bucket.\n";
+        return;
+    }
+    samples.resize(count);
+    unsigned char * raw = reinterpret_cast<unsigned char*>(samples.data());
+    for (size_t b=0; b < sizeof(Sample); ++b) {
+        const unsigned char * plane = &shuffled[b*count];
+        for (size_t i=0; i < count; ++i)
+            raw[i*sizeof(Sample) + b] = plane[i];
+    }
+}
+
+size_t SampleBucket::registerBucket(BucketVector & bucketVector, size_t * packedbytes) 
 {
     // update BucketGrid;
     // std::lock_guard<std::mutex> guard(automattes_mutex);
     // temporarly heavily inefficient just to prove the point.
-    bucketVector.push_back(*this);
+    // Registered copy is packed before it's published, so neighbours never
+    // see it half way.
+    SampleBucket cold;
+    cold.myBbox = myBbox;
+    cold.myRegisteredFlag = 1;
+    const size_t bytes = cold.pack(mySamples);
+    if (packedbytes)
+        *packedbytes = bytes;
+    bucketVector.push_back(std::move(cold));
     myRegisteredFlag  = 1;
     return bucketVector.size();
 
@@ -227,27 +612,27 @@ size_t SampleBucket::registerBucket()
     // }
 }
 
-int SampleBucket::fillBucket(const UT_Vector3 & min, const UT_Vector3 & max, SampleBucket * bucket) 
+int SampleBucket::fillBucket(const UT_Vector3 & min, const UT_Vector3 & max, SampleBucket * bucket,
+    const BucketVector & bucketVector, const size_t registered) 
 {
     // std::lock_guard<std::mutex> guard(automattes_mutex);
+    TraceScope trace("fill");
     int counter = 0;
     const UT_Vector3 dir(max - min);
     const UT_Vector3 max2(min.x(), max.y(), max.z());
     const UT_Vector3 min2(max.x(), min.y(), min.z());
-    const BucketVector::const_iterator it = bucketVector.begin();
-    for(; it!=bucketVector.end(); ++it) {
-        // const SampleBucket * store = static_cast<SampleBucket*>(*it);
-        const SampleBucket & store = *it;
+    thread_local SampleBucketV unpacked;
+    // end() may reach a bucket the worker is still moving in.
+    for (size_t i = 0; i < registered; ++i) {
+        const SampleBucket & store = bucketVector[i];
         const UT_BoundingBox * bbox = store.getBBox();
         // if (bbox->isInside(min) || bbox->isInside(max) \
             // || bbox->isInside(min2) || bbox->isInside(max2)) {
         if (bbox->isLineInside(min, dir)) {
             counter++;
-            size_t size = store.size();
-            for(size_t i=0; i < size; ++i) {
-                const Sample & vexsample = store.at(i);
-                mySamples.push_back(vexsample);
-            }
+            // decompressed only when footprint reaches it.
+            store.unpack(unpacked);
+            append(unpacked);
         }
     }
 
@@ -321,6 +706,154 @@ int VEX_getBucket(const int thread_id, SampleBucket * bucket, int & offset)
     // return offset;
 }
 
+namespace {
+    // Asset is the network right below the object root: /obj/<asset>/...
+    std::string assetName(const char * objname)
+    {
+        std::vector<std::string> parts;
+        std::string part;
+        for (const char * c = objname; *c; ++c) {
+            if (*c == '/') {
+                if (!part.empty()) parts.push_back(part);
+                part.clear();
+            } else {
+                part += *c;
+            }
+        }
+        if (!part.empty()) parts.push_back(part);
+        if (parts.empty())
+            return std::string(objname);
+        return (parts.size() > 1) ? parts[1] : parts[0];
+    }
+}
+
+int AutomatteSession::registerObject(const uint32_t objid, const char * objname, 
+    const char * groups, const char * material)
+{
+    {
+        ObjectTable::const_accessor ra;
+        if (myIdObjects.find(ra, objid))
+            return 0;
+    }
+
+    ObjectEntry entry = {0, 0, 0};
+    const std::string asset = assetName(objname);
+    MurmurHash3_x86_32(asset.c_str(), asset.size(), 0, &entry.asset);
+    if (material)
+        MurmurHash3_x86_32(material, std::strlen(material), 0, &entry.material);
+
+    // split space or comma separated group list.
+    std::vector<std::string> names;
+    std::string name;
+    for (const char * c = groups; ; ++c) {
+        if (*c == 0 || *c == ' ' || *c == ',') {
+            if (!name.empty()) names.push_back(name);
+            name.clear();
+            if (*c == 0) break;
+        } else {
+            name += *c;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(myIdMutex);
+        std::vector<const void*> keys;
+        std::vector<int> lens;
+        std::vector<std::string> newnames;
+        for (size_t i = 0; i < names.size(); ++i) {
+            std::map<std::string, int>::const_iterator it = myIdGroups.find(names[i]);
+            if (it != myIdGroups.end()) {
+                entry.groups |= GroupMask(1) << it->second;
+            } else if (myIdGroups.size() + newnames.size() < MaxGroups) {
+                newnames.push_back(names[i]);
+            } else {
+                std::cerr << "Automattes: too many groups, ignoring: " << names[i] << "\n";
+            }
+        }
+        // hash all groups seen first time at once.
+        for (size_t i = 0; i < newnames.size(); ++i) {
+            keys.push_back(newnames[i].c_str());
+            lens.push_back(static_cast<int>(newnames[i].size()));
+        }
+        std::vector<uint32_t> hashes(newnames.size());
+        if (!newnames.empty())
+            MurmurHash3_x86_32_batch(&keys[0], &lens[0], keys.size(), 0, &hashes[0]);
+        for (size_t i = 0; i < newnames.size(); ++i) {
+            const int bit = myIdGroupHashes.size();
+            myIdGroups.insert(std::pair<std::string, int>(newnames[i], bit));
+            myIdGroupHashes.push_back(hashes[i]);
+            entry.groups |= GroupMask(1) << bit;
+        }
+
+        ObjectTable::accessor wa;
+        if (!myIdObjects.insert(wa, objid))
+            return 0; // another thread was first
+        wa->second = entry;
+        myIdTablesVersion++;
+    }
+    return 1;
+}
+
+bool AutomatteSession::findObject(const uint32_t objid, uint32_t & material) const
+{
+    ObjectTable::const_accessor ra;
+    if (!myIdObjects.find(ra, objid))
+        return false;
+    material = ra->second.material;
+    return true;
+}
+
+IdTablesPtr AutomatteSession::getIdTables()
+{
+    std::lock_guard<std::mutex> guard(myIdMutex);
+    const int version = myIdTablesVersion.load();
+    if (myIdSnapshot && version == myIdSnapshotVersion)
+        return myIdSnapshot;
+
+    // dense tables indexed by object id, so filters do a single load per sample.
+    std::shared_ptr<IdTables> tables = std::make_shared<IdTables>();
+    uint32_t maxid = 0;
+    ObjectTable::const_iterator it = myIdObjects.begin();
+    for (; it != myIdObjects.end(); ++it)
+        maxid = SYSmax(maxid, it->first);
+    if (!myIdObjects.empty()) {
+        tables->assets.resize(maxid + 1, 0);
+        tables->groups.resize(maxid + 1, 0);
+    }
+    for (it = myIdObjects.begin(); it != myIdObjects.end(); ++it) {
+        tables->assets[it->first] = it->second.asset;
+        tables->groups[it->first] = it->second.groups;
+    }
+    tables->groupHashes = myIdGroupHashes;
+
+    myIdSnapshot = tables;
+    myIdSnapshotVersion = version;
+    return myIdSnapshot;
+}
+
+uint32_t AutomatteSession::mergeTile(const TileKey key, const SampleBucket & bucket)
+{
+    ProgressiveTiles::accessor wa;
+    myTiles.insert(wa, key);
+    const SampleBucketV & samples = bucket.getMySamples();
+    wa->second.samples.insert(wa->second.samples.end(), samples.begin(), samples.end());
+    return ++wa->second.generation;
+}
+
+uint32_t AutomatteSession::fillTile(const TileKey key, SampleBucket * bucket)
+{
+    ProgressiveTiles::const_accessor ra;
+    if (!myTiles.find(ra, key))
+        return 0;
+    bucket->append(ra->second.samples);
+    return ra->second.generation;
+}
+
+void AutomatteSession::resetTiles()
+{
+    myTiles.clear();
+}
+
 #if 0
 int 
 VEX_SampleClass::open_channel(const std::string & channel)
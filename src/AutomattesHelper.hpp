@@ -5,14 +5,46 @@
 
 #define CONCURRENT_HASH_MAP
 
+#include "AutomattesRank.hpp"
+
 namespace HA_HDK {
 
-// our fixed sample: x,y,z,id,Af 
-typedef std::vector<float> Sample; 
+// Object membership resolved once per object and render: asset hash and
+// a bitset of groups it belongs to (groups are interned in first seen order).
+typedef uint64_t GroupMask;
+static const int MaxGroups = 64;
+
+struct IdTables
+{
+    std::vector<uint32_t>  assets;      // object id -> asset hash
+    std::vector<GroupMask> groups;      // object id -> group bitset
+    std::vector<uint32_t>  groupHashes; // group bit -> group hash
+
+    uint32_t asset(const uint32_t objid) const noexcept 
+        { return (objid < assets.size()) ? assets[objid] : 0; }
+    GroupMask group(const uint32_t objid) const noexcept 
+        { return (objid < groups.size()) ? groups[objid] : 0; }
+};
+typedef std::shared_ptr<const IdTables> IdTablesPtr;
+
+// our fixed sample: x,y,z,id,Af,thread
+// Ids stay integral from the shader down to the filter's output, so
+// they never lose precision above 2^24 or compare as NaN patterns.
+struct Sample
+{
+    float    x;
+    float    y;
+    float    z;
+    uint32_t id;
+    float    Af;
+    uint32_t thread;
+};
 // vector of samples per thread (reused by many buckets)
 typedef std::vector<Sample> SampleBucketV;
 
-
+class SampleBucket;
+// registered (finished) buckets of a session.
+typedef tbb::concurrent_vector<SampleBucket>    BucketVector;
 
 class SampleBucket
 {
@@ -23,20 +55,34 @@ public:
     const UT_BoundingBox * getBBox() const noexcept { return &myBbox; }
     const SampleBucketV & getMySamples() const noexcept { return mySamples; }
     const int isRegistered() const noexcept { return myRegisteredFlag; } 
+    void markRegistered() noexcept { myRegisteredFlag = 1; }
     void clearNeighbours() noexcept;
     void clear() noexcept;
     void push_back(const Sample & sample) { mySamples.push_back(sample); }
+    void append(const SampleBucketV & samples) 
+        { mySamples.insert(mySamples.end(), samples.begin(), samples.end()); }
+    void swapSamples(SampleBucketV & samples) noexcept { mySamples.swap(samples); }
     void updateBoundingBox(const float &, const float &, const float &);
-    size_t registerBucket();
-    int  fillBucket(const UT_Vector3 &, const UT_Vector3 &, SampleBucket *);
+    // registered copy is kept packed until neighbours' filters need it.
+    size_t registerBucket(BucketVector &, size_t * packedbytes = nullptr);
+    // scans the first registered buckets of the vector, the only ones fully built.
+    int  fillBucket(const UT_Vector3 &, const UT_Vector3 &, SampleBucket *, const BucketVector &,
+        const size_t registered);
     void findBucket(const float &, const float &, 
         const float &, const float &, SampleBucket *) const;
+    // Cold storage: samples byte-shuffled (all first bytes, then second...)
+    // so similar positions and ids line up for zlib.
+    size_t pack(const SampleBucketV &);
+    void   unpack(SampleBucketV &) const;
+    const int isPacked() const noexcept { return myPackedCount != 0; }
 private:
     SampleBucketV mySamples;
     UT_BoundingBox myBbox;
     int myRegisteredFlag = 0;
     SampleBucketV myNeighbours;
     size_t myNeighbourSize = 0;
+    std::vector<unsigned char> myPacked;
+    size_t myPackedCount = 0;
 };
 
 typedef std::vector<SampleBucket>BucketQueue;
@@ -47,31 +93,226 @@ typedef std::map<int, BucketQueue> VEX_Samples;
 #endif
 typedef std::map<std::string, VEX_Samples> VEX_Channels;
 
-// storage per channel.
-typedef std::map<int, int> BucketCounter;
 // main storage container.
 typedef std::array<int, 2> BucketSize;
+// image resolution reported by shaders.
+typedef std::array<int, 2> ImageSize;
+// NDC xmin, xmax, ymin, ymax, as mantra's image:crop
+typedef std::array<float, 4> CropWindow;
 
 //
 typedef float coord_t;
 // typedef std::vector<SampleBucket*>    BucketVector;
-typedef tbb::concurrent_vector<SampleBucket>    BucketVector;
 // typedef std::map<coord_t, SampleBucket*> BucketGrid;
 
 
+// Progressive and IPR renders: samples of a tile (keyed by its pixel origin)
+// accumulated across passes, generation is bumped by every pass adding samples.
+typedef uint64_t TileKey;
+struct ProgressiveTile
+{
+    SampleBucketV samples;
+    uint32_t generation = 0;
+};
+typedef tbb::concurrent_hash_map<TileKey, ProgressiveTile> ProgressiveTiles;
+
+inline TileKey VEX_Tiles_key(const int x, const int y) 
+{
+    return (static_cast<TileKey>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+}
+
 // pointgrid stuff useful for buliding filter side accesor.
 typedef  UT_PointGridVector3ArrayAccessor<int, int> UT_Vector3Point;
 typedef  UT_PointGrid<UT_Vector3Point>::queuetype UT_Vector3PointQueue;
 
-// function exposed on vex side (temporarily instead of proper class)
-int VEX_Samples_create(const int&);
-int VEX_Samples_insert(const int&, const Sample&);
-void VEX_Samples_insertBucket(const int&);
-VEX_Samples * VEX_Samples_get();
-int VEX_Samples_increamentBucketCounter(const int&);
-BucketSize * VEX_getBucketSize();
-void VEX_setBucketSize(int x, int y);
-int VEX_bucketSizeSet();
+// Everything one render shares between its shaders and filters. Several
+// renders may run in one process (batch, IPR next to a farm preview), each
+// addressing its own session by name, so none of them sees the others' samples.
+class AutomatteSession
+{
+public:
+    AutomatteSession(const std::string & name, const int handle);
+    ~AutomatteSession();
+
+    const std::string & getName() const noexcept { return myName; }
+    int getHandle() const noexcept { return myHandle; }
+
+    // per thread sample stores
+    int  createStore(const int&);
+    int  insert(const int&, const Sample&);
+    void insertBucket(const int&);
+    VEX_Samples * getSamples() noexcept { return &mySamples; }
+    BucketVector & getBucketVector() noexcept { return myBucketVector; }
+    // buckets of the vector the worker finished constructing.
+    size_t getRegisteredCount() const noexcept 
+        { return myRegistered.load(std::memory_order_acquire); }
+
+    BucketSize * getBucketSize() noexcept { return &myBucketSize; }
+    void setBucketSize(int x, int y);
+    ImageSize getImageSize() const;
+    void setImageSize(int x, int y);
+    // render's crop region, whole image unless shaders tell otherwise.
+    CropWindow getCrop() const;
+    void setCrop(const CropWindow &);
+
+    // id tables
+    int  registerObject(const uint32_t, const char *, const char *, const char * = nullptr);
+    // true once object was registered, with its material's hash.
+    bool findObject(const uint32_t, uint32_t &) const;
+    IdTablesPtr getIdTables();
+
+    // registers filtered bucket for neighbours, accounting its cold size.
+    size_t registerBucket(SampleBucket &);
+    // filter's per thread scratch after a bucket: bytes it holds, and
+    // whether the bucket had to grow it (render statistics).
+    void countScratch(const size_t, const bool);
+    // Rank planes of one kind (ids, hash, source, filter width, packing) see
+    // the same ids per pixel: they register that kind once and get its index.
+    int registerPlane(const std::string &);
+    // Planes of a kind, named by their first pair: ids per pixel of a bucket,
+    // and bucket's most ids a pixel holds. Kind's lowest plane never skips, 
+    // so its counts cover the render and are reported.
+    void countIds(const int, const int, const IdCountHistogram &);
+    void setBucketIds(const int, const TileKey, const int, const int);
+    // true if a lower plane of the kind filtered the bucket and none of its
+    // pixels reaches this plane's first pair (counted as skipped).
+    bool emptyRank(const int, const TileKey, const int);
+    // Hands bucket's samples over to session's worker, which bounds, sorts, 
+    // packs and registers them off the render threads. Returns buckets published so far.
+    size_t publishBucket(SampleBucket &);
+    // blocks until everything published so far is registered.
+    void waitIndexed();
+
+    // progressive tiles
+    uint32_t mergeTile(const TileKey, const SampleBucket &);
+    uint32_t fillTile(const TileKey, SampleBucket *);
+    void resetTiles();
+
+    // Deep and partial id files are session's: first plane naming a file makes
+    // its writer, planes after it get null and the kind of plane writing it.
+    template <typename Writer, typename Make>
+    std::shared_ptr<Writer> fileWriter(const std::string & filename, std::string & kind, 
+        Make make)
+    {
+        std::lock_guard<std::mutex> guard(myFileMutex);
+        FileOwner & owner = myFileOwners[filename];
+        if (!owner.writer.expired()) {
+            kind = owner.kind;
+            return nullptr;
+        }
+        std::shared_ptr<Writer> writer = make();
+        owner.writer = writer;
+        owner.kind   = kind;
+        return writer;
+    }
+
+private:
+    struct ObjectEntry
+    {
+        uint32_t  asset  = 0;
+        GroupMask groups = 0;
+        uint32_t  material = 0;
+    };
+    typedef tbb::concurrent_hash_map<uint32_t, ObjectEntry> ObjectTable;
+
+    std::string  myName;
+    int          myHandle;
+    std::mutex   myMutex;
+    VEX_Samples  mySamples;
+    BucketVector myBucketVector;
+    // published after each push_back is fully built, readers stop there.
+    std::atomic<size_t> myRegistered;
+    BucketSize   myBucketSize;
+    std::atomic<int> myImageSizeX;
+    std::atomic<int> myImageSizeY;
+    std::atomic<float> myCrop[4];
+
+    std::mutex   myIdMutex;
+    ObjectTable  myIdObjects;
+    std::map<std::string, int> myIdGroups;
+    std::vector<uint32_t> myIdGroupHashes;
+    std::atomic<int> myIdTablesVersion;
+    IdTablesPtr  myIdSnapshot;
+    int          myIdSnapshotVersion;
+
+    ProgressiveTiles myTiles;
+
+    // cold (registered) buckets: raw vs resident bytes
+    std::atomic<size_t> myColdRawBytes;
+    std::atomic<size_t> myColdPackedBytes;
+
+    // filters' scratch: buckets, ones its capacity grew in, largest footprint
+    std::atomic<size_t> myScratchBuckets;
+    std::atomic<size_t> myScratchGrown;
+    std::atomic<size_t> myScratchBytes;
+
+    // id files by name, with plane kind writing them
+    struct FileOwner
+    {
+        std::weak_ptr<void> writer;
+        std::string kind;
+    };
+    std::mutex   myFileMutex;
+    std::map<std::string, FileOwner> myFileOwners;
+
+    // rank planes' ids per pixel (by kind, then first pair) and buckets' most
+    // ids (by kind and bucket origin)
+    struct BucketIds
+    {
+        int firstpair;
+        int maxids;
+    };
+    struct PlaneBucket
+    {
+        int     plane;
+        TileKey bucket;
+    };
+    struct PlaneBucketCompare
+    {
+        static size_t hash(const PlaneBucket & key) 
+        { return std::hash<TileKey>()(key.bucket) ^ (static_cast<size_t>(key.plane) * 0x9e3779b97f4a7c15ull); }
+        static bool equal(const PlaneBucket & a, const PlaneBucket & b) 
+        { return a.plane == b.plane && a.bucket == b.bucket; }
+    };
+    typedef tbb::concurrent_hash_map<PlaneBucket, BucketIds, PlaneBucketCompare> BucketIdTable;
+    std::mutex   myIdCountMutex;
+    std::vector<std::string> myPlaneKinds;
+    std::vector<std::map<int, IdCountHistogram> > myIdCounts;
+    BucketIdTable myBucketIds;
+    std::atomic<size_t> myRankSkips;
+
+    // Published buckets waiting for the worker: Vyukov's intrusive MPSC 
+    // queue, filters push without locks, the worker alone pops.
+    struct PendingBucket
+    {
+        std::atomic<PendingBucket*> next;
+        SampleBucketV samples;
+    };
+    void pushPending(PendingBucket *);
+    PendingBucket * popPending();
+    void indexBuckets();
+
+    std::atomic<PendingBucket*> myPendingHead;
+    PendingBucket *  myPendingTail;
+    PendingBucket    myPendingStub;
+    std::atomic<size_t> myPublished;
+    std::atomic<size_t> myIndexed;
+    std::mutex       myWorkerMutex;
+    std::condition_variable myWorkerWake;
+    std::condition_variable myIndexedWake;
+    bool             myWorkerDone;
+    std::thread      myWorker;
+};
+typedef std::shared_ptr<AutomatteSession> AutomatteSessionPtr;
+
+// Filters acquire a session by name (created on first use, released with
+// the last filter holding it); shaders find its handle by name and resolve
+// it per sample without locking.
+AutomatteSessionPtr VEX_Session_acquire(const char *);
+int VEX_Session_find(const char *);
+// changes whenever a session opens or closes, i.e. handles may mean another session.
+int VEX_Session_epoch();
+AutomatteSession * VEX_Session_get(const int);
 int VEX_getBucket(const int, SampleBucket *, int &);
 
 } // end of HA_HDK Space
@@ -0,0 +1,415 @@
+/*
+ Merges partial files of a crop split render (filter's -b) into one deep id
+ file of the whole image.
+
+ Nodes can't filter pixels next to their crop's edge, their footprints read
+ subpixels rendered elsewhere. Those seam pixels, found from each node's crop
+ window, are refiltered here from bands of subpixels every node saves along
+ its crop's edges, all other pixels are copied. Subpixels no band holds were
+ left unshaded (filter saves nothing of buckets without shaded subpixels), so
+ they count as background. Output is processed in tiles by a pool of threads, each reading
+ only partial buckets around its tile, and tiles are streamed to the
+ writer, so memory stays bounded by tiles in flight.
+
+ usage: AutomattesMerge [-t tile] [-j threads] -o merged.adid node1.adpt node2.adpt ...
+
+ Merged file is a deep id file like the filter's -h deep one. Test locally by
+ rendering the same frame in a few mantra processes, each with its own crop
+ region and -b file, plus one without a crop, merged alone, and comparing
+ both files' lists (see README).
+ */
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "AutomattesDeepWriter.hpp"
+#include "AutomattesFootprint.hpp"
+
+using namespace HA_HDK;
+
+namespace {
+
+typedef std::pair<uint32_t, float> IdCoverageEntry;
+
+struct PartialHeader
+{
+    int32_t  res[2];
+    uint32_t buckets;
+    int32_t  spp[2];
+    float    width;
+    float    alpha;
+    int32_t  crop[4]; // x0, y0, x1, y1 pixels, end exclusive
+};
+
+// where a partial bucket lives on disk.
+struct PartialIndex
+{
+    int      file;
+    int32_t  x, y, width, height;
+    uint32_t count;
+    uint32_t bandcount;
+    uint32_t rawsize;
+    uint32_t packedsize;
+    long     offset;
+};
+
+struct PartialFile
+{
+    std::string   name;
+    int           fd = -1;
+    PartialHeader header;
+};
+
+bool readHeader(std::FILE * file, PartialHeader & header)
+{
+    char magic[4];
+    uint32_t version = 0;
+    if (std::fread(magic, 1, 4, file) != 4 || std::memcmp(magic, PartialMagic, 4) != 0)
+        return false;
+    if (std::fread(&version, sizeof(uint32_t), 1, file) != 1 || version != PartialVersion)
+        return false;
+    return std::fread(header.res, sizeof(int32_t), 2, file) == 2
+        && std::fread(&header.buckets, sizeof(uint32_t), 1, file) == 1
+        && std::fread(header.spp, sizeof(int32_t), 2, file) == 2
+        && std::fread(&header.width, sizeof(float), 1, file) == 1
+        && std::fread(&header.alpha, sizeof(float), 1, file) == 1
+        && std::fread(header.crop, sizeof(int32_t), 4, file) == 4;
+}
+
+// Reads bucket records without their payload.
+bool indexFile(const int fileidx, const std::string & name, PartialHeader & header,
+    std::vector<PartialIndex> & index)
+{
+    std::FILE * file = std::fopen(name.c_str(), "rb");
+    if (!file || !readHeader(file, header)) {
+        std::cerr << "AutomattesMerge: not a partial file: " << name << "\n";
+        if (file) std::fclose(file);
+        return false;
+    }
+    for (uint32_t i = 0; i < header.buckets; ++i) {
+        PartialIndex entry;
+        int32_t  dims[4];
+        uint32_t sizes[4];
+        if (std::fread(dims, sizeof(int32_t), 4, file) != 4
+            || std::fread(sizes, sizeof(uint32_t), 4, file) != 4) {
+            std::cerr << "AutomattesMerge: truncated file: " << name << "\n";
+            break;
+        }
+        entry.file = fileidx;
+        entry.x = dims[0]; entry.y = dims[1]; entry.width = dims[2]; entry.height = dims[3];
+        entry.count = sizes[0]; entry.bandcount = sizes[1];
+        entry.rawsize = sizes[2]; entry.packedsize = sizes[3];
+        entry.offset = std::ftell(file);
+        index.push_back(entry);
+        std::fseek(file, entry.packedsize, SEEK_CUR);
+    }
+    std::fclose(file);
+    return true;
+}
+
+template<typename T>
+const unsigned char * readPlane(const unsigned char * raw, std::vector<T> & plane, const size_t size)
+{
+    plane.resize(size);
+    if (size)
+        std::memcpy(plane.data(), raw, size*sizeof(T));
+    return raw + size*sizeof(T);
+}
+
+bool loadBucket(const PartialFile & file, const PartialIndex & entry, DeepBucket & bucket)
+{
+    std::vector<unsigned char> packed(entry.packedsize);
+    std::vector<unsigned char> raw(entry.rawsize);
+    if (pread(file.fd, packed.data(), entry.packedsize, entry.offset) != (ssize_t)entry.packedsize)
+        return false;
+    uLongf rawsize = entry.rawsize;
+    if (uncompress(raw.data(), &rawsize, packed.data(), packed.size()) != Z_OK \
+        || rawsize != entry.rawsize)
+        return false;
+
+    const size_t pixels = entry.width*entry.height;
+    bucket.x = entry.x; bucket.y = entry.y;
+    bucket.width = entry.width; bucket.height = entry.height;
+    const unsigned char * ptr = raw.data();
+    ptr = readPlane(ptr, bucket.counts,   pixels);
+    ptr = readPlane(ptr, bucket.ids,      entry.count);
+    ptr = readPlane(ptr, bucket.coverage, entry.count);
+    ptr = readPlane(ptr, bucket.depth,    entry.count);
+    ptr = readPlane(ptr, bucket.bandx,    entry.bandcount);
+    ptr = readPlane(ptr, bucket.bandy,    entry.bandcount);
+    ptr = readPlane(ptr, bucket.bandids,  entry.bandcount);
+    ptr = readPlane(ptr, bucket.bandcoverage, entry.bandcount);
+    ptr = readPlane(ptr, bucket.bandnorm, entry.bandcount);
+    return true;
+}
+
+bool overlaps(const PartialIndex & entry, const int x0, const int y0, const int x1, const int y1)
+{
+    return entry.x < x1 && entry.x + entry.width > x0 && entry.y < y1 && entry.y + entry.height > y0;
+}
+
+struct Merge
+{
+    std::vector<PartialFile>  files;
+    std::vector<PartialIndex> index;
+    PartialHeader header;
+    int tile = 64;
+    // footprint
+    int footoff[2];
+    std::vector<float> weights[2];
+    int halo; // pixels a footprint reaches beyond its own one
+
+    void mergeTile(const int tx, const int ty, DeepIdWriter & writer) const;
+    // pixel's footprint reads past its node's crop.
+    bool seam(const int x, const int y, const PartialHeader & node) const
+    {
+        return footprintLeavesCrop(x, header.spp[0], footoff[0], weights[0].size(), 
+                node.crop[0], node.crop[2], header.res[0]) \
+            || footprintLeavesCrop(y, header.spp[1], footoff[1], weights[1].size(), 
+                node.crop[1], node.crop[3], header.res[1]);
+    }
+};
+
+void Merge::mergeTile(const int tx, const int ty, DeepIdWriter & writer) const
+{
+    const int x0 = tx, y0 = ty;
+    const int x1 = std::min(tx + tile, header.res[0]);
+    const int y1 = std::min(ty + tile, header.res[1]);
+    const int width = x1 - x0, height = y1 - y0;
+
+    // Buckets covering the tile give pixels' lists, ones around give bands.
+    std::vector<DeepBucket> buckets;
+    std::vector<int> bucketfile;
+    for (size_t i = 0; i < index.size(); ++i) {
+        if (!overlaps(index[i], x0 - 2*halo, y0 - 2*halo, x1 + 2*halo, y1 + 2*halo))
+            continue;
+        DeepBucket bucket;
+        if (!loadBucket(files[index[i].file], index[i], bucket)) {
+            std::cerr << "AutomattesMerge: can't read bucket at " << index[i].x << ", "
+                << index[i].y << " from " << files[index[i].file].name << "\n";
+            continue;
+        }
+        buckets.push_back(std::move(bucket));
+        bucketfile.push_back(index[i].file);
+    }
+    if (buckets.empty())
+        return;
+
+    // Pixel's node: file whose crop holds it. Pixels of none (crops of nodes 
+    // where nothing got shaded) are refiltered like seams.
+    std::vector<int> node(width*height, -1);
+    for (int iy = 0; iy < height; ++iy) {
+        for (int ix = 0; ix < width; ++ix) {
+            for (size_t f = 0; f < files.size(); ++f) {
+                const int32_t * crop = files[f].header.crop;
+                if (x0 + ix >= crop[0] && x0 + ix < crop[2] && y0 + iy >= crop[1] && y0 + iy < crop[3]) {
+                    node[iy*width + ix] = f;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Pixel's owner: node's bucket and its first id, -1 where node saved no
+    // bucket (nothing shaded in its reach).
+    std::vector<int> owner(width*height, -1);
+    std::vector<uint32_t> first(width*height, 0);
+    // Band subpixels by image subpixel coordinates. Neighbouring buckets of
+    // one node save their common subpixels twice, first one is kept.
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t> > band;
+    std::vector<const DeepBucket*> bandbucket;
+    for (size_t b = 0; b < buckets.size(); ++b) {
+        const DeepBucket & bucket = buckets[b];
+        uint32_t offset = 0;
+        for (int y = 0; y < bucket.height; ++y) {
+            for (int x = 0; x < bucket.width; ++x) {
+                const int pixel = y*bucket.width + x;
+                const int ix = bucket.x + x - x0, iy = bucket.y + y - y0;
+                if (ix >= 0 && iy >= 0 && ix < width && iy < height && owner[iy*width + ix] < 0 \
+                    && node[iy*width + ix] == bucketfile[b]) {
+                    owner[iy*width + ix] = b;
+                    first[iy*width + ix] = offset;
+                }
+                offset += bucket.counts[pixel];
+            }
+        }
+        const uint32_t size = bucket.bandids.size();
+        for (uint32_t i = 0; i < size;) {
+            uint32_t end = i + 1;
+            while (end < size && bucket.bandx[end] == bucket.bandx[i] && bucket.bandy[end] == bucket.bandy[i])
+                ++end;
+            const uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(bucket.bandx[i])) << 32) \
+                | static_cast<uint32_t>(bucket.bandy[i]);
+            if (band.find(key) == band.end()) {
+                band[key] = std::make_pair(static_cast<uint32_t>(bandbucket.size()), i);
+                bandbucket.push_back(&bucket);
+            }
+            i = end;
+        }
+    }
+
+    DeepBucket merged;
+    merged.x = x0; merged.y = y0;
+    merged.width = width; merged.height = height;
+    merged.counts.resize(width*height, 0);
+    std::vector<IdCoverageEntry> accumulator;
+    for (int iy = 0; iy < height; ++iy) {
+        for (int ix = 0; ix < width; ++ix) {
+            const int pixel = iy*width + ix;
+            if (node[pixel] >= 0 && !seam(x0 + ix, y0 + iy, files[node[pixel]].header)) {
+                if (owner[pixel] < 0)
+                    continue;
+                const DeepBucket & bucket = buckets[owner[pixel]];
+                const int bx = x0 + ix - bucket.x, by = y0 + iy - bucket.y;
+                const uint32_t count = bucket.counts[by*bucket.width + bx];
+                for (uint32_t i = 0; i < count; ++i) {
+                    merged.ids.push_back(bucket.ids[first[pixel] + i]);
+                    merged.coverage.push_back(bucket.coverage[first[pixel] + i]);
+                    merged.depth.push_back(bucket.depth[first[pixel] + i]);
+                }
+                merged.counts[pixel] = count;
+                continue;
+            }
+
+            // seam: filter subpixels from all nodes' bands.
+            accumulator.clear();
+            float norm = 0.f;
+            const int sx0 = (x0 + ix)*header.spp[0] + footoff[0];
+            const int sy0 = (y0 + iy)*header.spp[1] + footoff[1];
+            for (size_t fy = 0; fy < weights[1].size(); ++fy) {
+                for (size_t fx = 0; fx < weights[0].size(); ++fx) {
+                    const int32_t sx = sx0 + fx, sy = sy0 + fy;
+                    const uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(sx)) << 32) \
+                        | static_cast<uint32_t>(sy);
+                    const float weight = weights[0][fx] * weights[1][fy];
+                    const auto it = band.find(key);
+                    if (it == band.end()) {
+                        norm += weight; // unshaded
+                        continue;
+                    }
+                    const DeepBucket & bucket = *bandbucket[it->second.first];
+                    for (uint32_t i = it->second.second; i < bucket.bandids.size() \
+                        && bucket.bandx[i] == sx && bucket.bandy[i] == sy; ++i) {
+                        norm += weight * bucket.bandnorm[i];
+                        if (bucket.bandcoverage[i] <= 0.f)
+                            continue;
+                        const uint32_t id = bucket.bandids[i];
+                        auto entry = std::find_if(accumulator.begin(), accumulator.end(),
+                            [id](const IdCoverageEntry & e) { return e.first == id; });
+                        if (entry == accumulator.end())
+                            accumulator.push_back(IdCoverageEntry(id, weight * bucket.bandcoverage[i]));
+                        else
+                            entry->second += weight * bucket.bandcoverage[i];
+                    }
+                }
+            }
+            if (norm <= 0.f)
+                continue;
+            for (size_t i = 0; i < accumulator.size(); ++i) {
+                merged.ids.push_back(accumulator[i].first);
+                merged.coverage.push_back(accumulator[i].second / norm);
+                merged.depth.push_back(FLT_MAX);
+            }
+            merged.counts[pixel] = accumulator.size();
+        }
+    }
+    writer.push(std::move(merged));
+}
+
+void usage()
+{
+    std::cerr << "usage: AutomattesMerge [-t tile] [-j threads] -o merged.adid node.adpt ...\n";
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char * argv[])
+{
+    Merge merge;
+    std::string output;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "-o" && i + 1 < argc)      output  = argv[++i];
+        else if (arg == "-t" && i + 1 < argc) merge.tile = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "-j" && i + 1 < argc) threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg[0] == '-') { usage(); return 1; }
+        else inputs.push_back(arg);
+    }
+    if (output.empty() || inputs.empty()) {
+        usage();
+        return 1;
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        PartialFile file;
+        file.name = inputs[i];
+        if (!indexFile(merge.files.size(), file.name, file.header, merge.index))
+            return 1;
+        // nodes where nothing got shaded know neither image nor crop.
+        if (file.header.buckets == 0) {
+            std::cerr << "AutomattesMerge: " << file.name << " has no buckets, skipped\n";
+            continue;
+        }
+        file.fd = open(file.name.c_str(), O_RDONLY);
+        const PartialHeader & h = file.header;
+        const PartialHeader & h0 = (merge.files.empty()) ? h : merge.files[0].header;
+        if (h.res[0] != h0.res[0] || h.res[1] != h0.res[1] || h.spp[0] != h0.spp[0] \
+            || h.spp[1] != h0.spp[1] || h.width != h0.width || h.alpha != h0.alpha) {
+            std::cerr << "AutomattesMerge: " << file.name << " doesn't match "
+                << merge.files[0].name << " (resolution, samples or filter)\n";
+            return 1;
+        }
+        merge.files.push_back(file);
+    }
+    if (merge.files.empty()) {
+        std::cerr << "AutomattesMerge: nothing to merge\n";
+        return 1;
+    }
+    merge.header = merge.files[0].header;
+    const PartialHeader & header = merge.header;
+
+    const float expv = std::exp(-header.alpha * header.width * header.width);
+    merge.halo = 0;
+    for (int axis = 0; axis < 2; ++axis) {
+        const int half = footprintHalfWidth(header.spp[axis], header.width);
+        buildFootprint(header.spp[axis], half, expv, header.alpha,
+            merge.footoff[axis], merge.weights[axis]);
+        merge.halo = std::max(merge.halo, (half + header.spp[axis] - 1) / header.spp[axis] + 1);
+    }
+
+    DeepIdWriter writer(output, 4*threads);
+    if (!writer.isOpen())
+        return 1;
+    writer.setImageSize(header.res[0], header.res[1]);
+
+    const int tilesx = (header.res[0] + merge.tile - 1) / merge.tile;
+    const int tilesy = (header.res[1] + merge.tile - 1) / merge.tile;
+    std::atomic<int> next(0);
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t) {
+        pool.push_back(std::thread([&]() {
+            for (int i = next++; i < tilesx*tilesy; i = next++)
+                merge.mergeTile((i % tilesx)*merge.tile, (i / tilesx)*merge.tile, writer);
+        }));
+    }
+    for (size_t t = 0; t < pool.size(); ++t)
+        pool[t].join();
+
+    for (size_t i = 0; i < merge.files.size(); ++i)
+        close(merge.files[i].fd);
+    return 0;
+}
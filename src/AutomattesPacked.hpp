@@ -0,0 +1,64 @@
+/*
+ Packed rank planes (filter's -k 1), shared with tools decoding them (no HDK).
+
+ Every channel holds a whole id/coverage pair, so a 4 channel plane carries
+ four pairs and rank n holds pairs 4(n-1)..4(n-1)+3. Channel's 32 bits are
+
+    bits 31..16 : q = 0x80 + round(coverage * 0x7eff)
+    bits 15..0  : low 16 bits of id (exact for object ids below 65536)
+
+ q keeps float's exponent in 1..254, so packed values are always positive,
+ normal, finite floats that survive float32 EXRs and FTZ unharmed, and they
+ grow with coverage. Empty pairs are 0. Hashed ids (assets, materials, groups)
+ would collide in 16 bits, so the filter packs object ids only and falls back
+ to rank planes, which keep ids whole, for the others.
+ Planes have to be saved as 32 bit floats.
+
+ Python, per channel value v:
+    b = struct.unpack('<I', struct.pack('<f', v))[0]
+    id, coverage = (b & 0xffff, ((b >> 16) - 0x80) / 32511.0) if b else (0, 0.0)
+ */
+#pragma once
+
+#ifndef __AutomattesPacked__
+#define __AutomattesPacked__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace HA_HDK {
+
+static const uint32_t PackedCoverageBias  = 0x80;
+static const uint32_t PackedCoverageScale = 0x7eff;
+static const int      PackedPairsPerPlane = 4;
+
+inline float packPair(const uint32_t id, const float coverage)
+{
+    const float clamped = std::min(std::max(coverage, 0.f), 1.f);
+    const uint32_t q = PackedCoverageBias + \
+        static_cast<uint32_t>(clamped * PackedCoverageScale + 0.5f);
+    const uint32_t bits = (q << 16) | (id & 0xffff);
+    float packed;
+    std::memcpy(&packed, &bits, sizeof(float));
+    return packed;
+}
+
+// Returns false for empty pairs.
+inline bool unpackPair(const float packed, uint32_t & id, float & coverage)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &packed, sizeof(float));
+    if (bits == 0) {
+        id = 0;
+        coverage = 0.f;
+        return false;
+    }
+    id = bits & 0xffff;
+    coverage = float((bits >> 16) - PackedCoverageBias) / float(PackedCoverageScale);
+    return true;
+}
+
+} // end of HA_HDK Space
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ Per pixel id accumulation and ranking, shared by the filter and offline
+ tools (no HDK).
+
+ Pixels collect (id, coverage) pairs, rank planes take them by coverage:
+ rank n holds pairs 2(n-1) and 2(n-1)+1 as (id, coverage, id, coverage),
+ packed rank n holds pairs 4(n-1)..4(n-1)+3 (see AutomattesPacked.hpp).
+
+ [1] - Jonah Friedman, Andrew C. Jones, Fully automatic ID mattes with support for motion blur and transparency.
+ */
+#pragma once
+
+#ifndef __AutomattesRank__
+#define __AutomattesRank__
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "AutomattesPacked.hpp"
+
+namespace HA_HDK {
+
+// accumulated coverage (and false color weight) of an id inside a pixel.
+struct IdCoverage
+{
+    uint32_t id;
+    float coverage;
+    float color;
+};
+typedef std::vector<IdCoverage> IdCoverageArray;
+
+// Flat per pixel accumulator: pixels see a handful of ids, so a linear scan
+// over integer keys beats any node based map.
+inline void accumulateId(IdCoverageArray & ids, const uint32_t id, 
+    const float coverage, const float color)
+{
+    const size_t size = ids.size();
+    for (size_t i = 0; i < size; ++i) {
+        if (ids[i].id == id) {
+            ids[i].coverage += coverage;
+            ids[i].color    += color;
+            return;
+        }
+    }
+    const IdCoverage entry = {id, coverage, color};
+    ids.push_back(entry);
+}
+
+// Bucket's distinct ids. Kernels encode ids into 16 bit slots once, while
+// resolving subpixels, so pixels accumulate into dense per slot arrays and
+// ids are decoded only for the pixel's final list.
+typedef uint16_t PaletteSlot;
+static const size_t PaletteCapacity = 0xffff; // last slot collects overflow as id 0
+
+class IdPalette
+{
+public:
+    IdPalette() : myShift(32), myOverflow(false) { myIds.reserve(64); rehash(128); }
+
+    PaletteSlot encode(const uint32_t id)
+    {
+        const size_t mask = myTable.size() - 1;
+        size_t i = home(id);
+        for (; myTable[i].slot; i = (i + 1) & mask) {
+            if (myTable[i].id == id)
+                return myTable[i].slot - 1;
+        }
+        if (myIds.size() >= PaletteCapacity) {
+            if (!myOverflow)
+                std::cerr << "Automattes: more than " << PaletteCapacity 
+                    << " ids in a bucket, dropping the rest.\n";
+            if (!myOverflow)
+                myIds.push_back(0);
+            myOverflow = true;
+            return PaletteCapacity;
+        }
+        const PaletteSlot slot = myIds.size();
+        myIds.push_back(id);
+        if (2*myIds.size() > myTable.size()) {
+            rehash(2*myTable.size());
+        } else {
+            const Entry entry = {id, static_cast<uint32_t>(slot) + 1};
+            myTable[i] = entry;
+        }
+        return slot;
+    }
+    uint32_t decode(const PaletteSlot slot) const noexcept { return myIds[slot]; }
+    size_t size() const noexcept { return myIds.size(); }
+
+    // Forgets ids, keeping the storage for the next bucket. Entries go in
+    // reverse insertion order, so probe chains stay intact until they do.
+    void clear()
+    {
+        const size_t mask  = myTable.size() - 1;
+        const size_t count = std::min(myIds.size(), PaletteCapacity);
+        for (size_t n = count; n-- > 0;) {
+            size_t i = home(myIds[n]);
+            while (myTable[i].slot != n + 1)
+                i = (i + 1) & mask;
+            myTable[i].slot = 0;
+        }
+        myIds.clear();
+        myOverflow = false;
+    }
+    size_t capacityBytes() const noexcept
+    {
+        return myIds.capacity()*sizeof(uint32_t) + myTable.capacity()*sizeof(Entry);
+    }
+
+private:
+    // open addressed, at most half full; slot is palette slot + 1, 0 if empty.
+    struct Entry
+    {
+        uint32_t id;
+        uint32_t slot;
+    };
+
+    // Mantra's ids are small integers, spread them over the table first.
+    size_t home(const uint32_t id) const noexcept
+    {
+        return static_cast<uint32_t>(id * 0x9e3779b1u) >> myShift;
+    }
+    void rehash(const size_t size)
+    {
+        myShift = 32;
+        for (size_t s = size; s > 1; s >>= 1)
+            --myShift;
+        myTable.assign(size, Entry());
+        const size_t count = std::min(myIds.size(), PaletteCapacity);
+        for (size_t n = 0; n < count; ++n) {
+            size_t i = home(myIds[n]);
+            while (myTable[i].slot)
+                i = (i + 1) & (size - 1);
+            const Entry entry = {myIds[n], static_cast<uint32_t>(n) + 1};
+            myTable[i] = entry;
+        }
+    }
+
+    std::vector<uint32_t> myIds;
+    std::vector<Entry>    myTable;
+    int  myShift;
+    bool myOverflow;
+};
+
+// Dense coverage per palette slot, only touched slots are visited and reset.
+class SlotAccumulator
+{
+public:
+    void resize(const size_t slots)
+    {
+        myCoverage.assign(slots, 0.f);
+        myColor.assign(slots, 0.f);
+        myUsed.assign(slots, 0);
+        myTouched.reserve(64);
+    }
+    void add(const PaletteSlot slot, const float coverage, const float color)
+    {
+        if (!myUsed[slot]) {
+            myUsed[slot] = 1;
+            myTouched.push_back(slot);
+        }
+        myCoverage[slot] += coverage;
+        myColor[slot]    += color;
+    }
+    // Decodes pixel's ids into the list ranks are picked from, and resets.
+    void flush(const IdPalette & palette, IdCoverageArray & ids)
+    {
+        ids.clear();
+        const size_t size = myTouched.size();
+        for (size_t i = 0; i < size; ++i) {
+            const PaletteSlot slot = myTouched[i];
+            const IdCoverage entry = {palette.decode(slot), myCoverage[slot], myColor[slot]};
+            ids.push_back(entry);
+            myCoverage[slot] = 0.f;
+            myColor[slot]    = 0.f;
+            myUsed[slot]     = 0;
+        }
+        myTouched.clear();
+    }
+    size_t capacityBytes() const noexcept
+    {
+        return (myCoverage.capacity() + myColor.capacity())*sizeof(float) \
+            + myUsed.capacity() + myTouched.capacity()*sizeof(PaletteSlot);
+    }
+
+private:
+    std::vector<float>       myCoverage;
+    std::vector<float>       myColor;
+    std::vector<uint8_t>     myUsed;
+    std::vector<PaletteSlot> myTouched;
+};
+
+// Ids per pixel over a render, to tell how many rank planes a shot needs.
+// Pixels with more ids than bins share the last bin, max stays exact.
+class IdCountHistogram
+{
+public:
+    static const size_t Bins = 65;
+
+    IdCountHistogram() : myMax(0) { myPixels.fill(0); }
+
+    void add(const size_t ids)
+    {
+        myPixels[std::min(ids, Bins - 1)]++;
+        myMax = std::max(myMax, ids);
+    }
+    void merge(const IdCountHistogram & other)
+    {
+        for (size_t i = 0; i < Bins; ++i)
+            myPixels[i] += other.myPixels[i];
+        myMax = std::max(myMax, other.myMax);
+    }
+    size_t pixels() const noexcept
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < Bins; ++i)
+            total += myPixels[i];
+        return total;
+    }
+    size_t max() const noexcept { return myMax; }
+    // fewest ids per pixel that fraction of pixels don't exceed.
+    size_t percentile(const double fraction) const noexcept
+    {
+        const double target = fraction * pixels();
+        size_t total = 0;
+        for (size_t i = 0; i + 1 < Bins; ++i) {
+            total += myPixels[i];
+            if (total >= target)
+                return i;
+        }
+        return myMax;
+    }
+
+private:
+    std::array<size_t, Bins> myPixels;
+    size_t myMax;
+};
+
+// planes needed to hold given number of ids, two pairs a plane or four packed.
+inline size_t rankPlanes(const size_t ids, const size_t pairsPerPlane)
+{
+    return (ids + pairsPerPlane - 1) / pairsPerPlane;
+}
+
+// From Cryptomatte specification[1]
+inline float hash_to_float(uint32_t hash)
+{
+    uint32_t mantissa = hash & (( 1 << 23) - 1);
+    uint32_t exponent = (hash >> 23) & ((1 << 8) - 1);
+    exponent = std::max(exponent, (uint32_t) 1);
+    exponent = std::min(exponent, (uint32_t) 254);
+    exponent = exponent << 23;
+    uint32_t sign = (hash >> 31);
+    sign = sign << 31;
+    uint32_t float_bits = sign | exponent | mantissa;
+    float f;
+    std::memcpy(&f, &float_bits, 4);
+    return f;
+}
+
+inline bool compareCoverage(const IdCoverage & a, const IdCoverage & b)
+{
+    return (a.coverage != b.coverage) ? a.coverage > b.coverage : a.id < b.id;
+}
+
+// Sorts just enough of ids to have pairs first..first+count in place,
+// returns where present ones end.
+inline size_t rankPairs(IdCoverageArray & ids, const size_t first, const size_t count)
+{
+    const size_t last = std::min(first + count, ids.size());
+    if (first < last)
+        std::partial_sort(ids.begin(), ids.begin() + last, ids.end(), compareCoverage);
+    return last;
+}
+
+// Rank planes count from 1, ids become floats through idToFloat.
+template<typename IdToFloat>
+inline void writeRank(float * destination, const int rank, IdCoverageArray & ids, 
+    const float norm, IdToFloat idToFloat)
+{
+    const size_t first = (static_cast<size_t>(rank) - 1) * 2;
+    const size_t last  = rankPairs(ids, first, 2);
+    for (size_t i = 0; i < 2; ++i) {
+        const size_t idx = first + i;
+        destination[2*i+0] = (idx < last) ? idToFloat(ids[idx].id) : 0.f;
+        destination[2*i+1] = (idx < last) ? ids[idx].coverage / norm : 0.f;
+    }
+}
+
+inline void writePackedRank(float * destination, const int rank, IdCoverageArray & ids, 
+    const float norm)
+{
+    const size_t first = (static_cast<size_t>(rank) - 1) * PackedPairsPerPlane;
+    const size_t last  = rankPairs(ids, first, PackedPairsPerPlane);
+    for (size_t i = 0; i < PackedPairsPerPlane; ++i) {
+        const size_t idx = first + i;
+        destination[i] = (idx < last) ? packPair(ids[idx].id, ids[idx].coverage / norm) : 0.f;
+    }
+}
+
+} // end of HA_HDK Space
+
+#endif
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include "AutomattesSidecar.hpp"
+
+namespace HA_HDK {
+
+namespace {
+    template<typename T>
+    void appendValue(std::vector<unsigned char> & chunk, const T & value)
+    {
+        const size_t offset = chunk.size();
+        chunk.resize(offset + sizeof(T));
+        std::memcpy(&chunk[offset], &value, sizeof(T));
+    }
+
+    bool compareMattePixel(const MattePixel & a, const MattePixel & b)
+    {
+        return (a.id != b.id) ? a.id < b.id : a.pixel < b.pixel;
+    }
+}
+
+MatteSidecar::MatteSidecar(const std::string & filename)
+    : myFilename(filename)
+    , myResX(0)
+    , myResY(0)
+{
+    myFile = std::fopen(filename.c_str(), "wb");
+    if (!myFile) {
+        std::cerr << "Automattes: can't open matte sidecar: " << filename << "\n";
+        return;
+    }
+    writeHeader();
+}
+
+MatteSidecar::~MatteSidecar()
+{
+    if (!myFile)
+        return;
+
+    // patch resolution now that we know it.
+    std::fseek(myFile, 0, SEEK_SET);
+    writeHeader();
+    std::fclose(myFile);
+    writeManifest();
+    std::cout << "Automattes: " << myIndex.size() << " id mattes saved to "
+        << myFilename << "\n";
+}
+
+void MatteSidecar::setImageSize(const int x, const int y) noexcept
+{
+    myResX.store(x, std::memory_order_relaxed);
+    myResY.store(y, std::memory_order_relaxed);
+}
+
+void MatteSidecar::writeHeader()
+{
+    const int32_t res[2] = {myResX.load(), myResY.load()};
+    std::fwrite(MatteSidecarMagic, 1, 4, myFile);
+    std::fwrite(&MatteSidecarVersion, sizeof(uint32_t), 1, myFile);
+    std::fwrite(res, sizeof(int32_t), 2, myFile);
+}
+
+void MatteSidecar::push(MatteBucket & bucket)
+{
+    if (!myFile || bucket.pixels.empty())
+        return;
+
+    // Chunks are encoded outside of the lock, only appending is serialized.
+    // One byte buffer per render thread holds them back to back, it keeps 
+    // its capacity so buckets after the largest one encode without allocating.
+    thread_local std::vector<unsigned char> bytes;
+    thread_local std::vector<size_t>   ends;
+    thread_local std::vector<IdIndex>  ranges;
+    thread_local std::vector<uint32_t> ids;
+    bytes.clear();
+    ends.clear();
+    ranges.clear();
+    ids.clear();
+    std::sort(bucket.pixels.begin(), bucket.pixels.end(), compareMattePixel);
+    const size_t size = bucket.pixels.size();
+    for (size_t i = 0; i < size;) {
+        const uint32_t id = bucket.pixels[i].id;
+        const size_t start = bytes.size();
+        IdIndex range;
+        uint32_t spans = 0;
+        appendValue(bytes, id);
+        appendValue(bytes, spans); // patched below
+        while (i < size && bucket.pixels[i].id == id) {
+            // span: neighbouring pixels of one row
+            const int pixel = bucket.pixels[i].pixel;
+            const int x = pixel % bucket.width, y = pixel / bucket.width;
+            size_t end = i + 1;
+            while (end < size && bucket.pixels[end].id == id \
+                && bucket.pixels[end].pixel == pixel + int(end - i) \
+                && (pixel + int(end - i)) / bucket.width == y)
+                ++end;
+            const uint32_t length = end - i;
+            appendValue(bytes, int32_t(bucket.x + x));
+            appendValue(bytes, int32_t(bucket.y + y));
+            appendValue(bytes, length);
+            for (; i < end; ++i)
+                appendValue(bytes, bucket.pixels[i].coverage);
+            range.bbox[0] = std::min(range.bbox[0], bucket.x + x);
+            range.bbox[1] = std::min(range.bbox[1], bucket.y + y);
+            range.bbox[2] = std::max(range.bbox[2], bucket.x + x + int(length) - 1);
+            range.bbox[3] = std::max(range.bbox[3], bucket.y + y);
+            range.pixels += length;
+            ++spans;
+        }
+        std::memcpy(&bytes[start + sizeof(uint32_t)], &spans, sizeof(uint32_t));
+        ends.push_back(bytes.size());
+        ranges.push_back(range);
+        ids.push_back(id);
+    }
+
+    std::lock_guard<std::mutex> guard(myMutex);
+    size_t start = 0;
+    for (size_t c = 0; c < ends.size(); ++c) {
+        const long offset = std::ftell(myFile);
+        std::fwrite(&bytes[start], 1, ends[c] - start, myFile);
+        IdIndex & index = myIndex[ids[c]];
+        for (int k = 0; k < 2; ++k) {
+            index.bbox[k]   = std::min(index.bbox[k],   ranges[c].bbox[k]);
+            index.bbox[k+2] = std::max(index.bbox[k+2], ranges[c].bbox[k+2]);
+        }
+        index.pixels += ranges[c].pixels;
+        index.chunks.push_back(std::make_pair(offset, static_cast<uint32_t>(ends[c] - start)));
+        start = ends[c];
+    }
+}
+
+void MatteSidecar::writeManifest() const
+{
+    const std::string filename = myFilename + ".json";
+    std::FILE * file = std::fopen(filename.c_str(), "w");
+    if (!file) {
+        std::cerr << "Automattes: can't open matte manifest: " << filename << "\n";
+        return;
+    }
+    std::fprintf(file, "{\"version\": %u, \"file\": \"%s\", \"resolution\": [%d, %d],\n \"ids\": {",
+        MatteSidecarVersion, myFilename.c_str(), myResX.load(), myResY.load());
+    std::map<uint32_t, IdIndex>::const_iterator it = myIndex.begin();
+    for (; it != myIndex.end(); ++it) {
+        const IdIndex & index = it->second;
+        std::fprintf(file, "%s\n  \"%u\": {\"hash\": \"%08x\", \"bbox\": [%d, %d, %d, %d], "
+            "\"pixels\": %llu, \"chunks\": [", (it == myIndex.begin()) ? "" : ",",
+            it->first, it->first, index.bbox[0], index.bbox[1], index.bbox[2], index.bbox[3],
+            static_cast<unsigned long long>(index.pixels));
+        for (size_t c = 0; c < index.chunks.size(); ++c)
+            std::fprintf(file, "%s[%ld, %u]", c ? ", " : "",
+                index.chunks[c].first, index.chunks[c].second);
+        std::fprintf(file, "]}");
+    }
+    std::fprintf(file, "\n }\n}\n");
+    std::fclose(file);
+}
+
+} // end of HA_HDK
@@ -0,0 +1,86 @@
+/*
+ Per id sparse matte sidecar (filter's -m).
+
+ Each filtered bucket saves one chunk per id it contains, holding that id's
+ coverage as row spans, and a JSON manifest written on close indexes
+ chunks and bounding box of every id. A single matte can be pulled by
+ reading only its chunks, so I/O follows object's screen area, not frame's.
+
+ File layout (native endianness):
+    header : char magic[4] = "ADMS", uint32 version, int32 resx, int32 resy
+    chunk  : uint32 id, uint32 span count, spans
+    span   : int32 x, int32 y, uint32 length, float coverage[length]
+
+ Manifest (file + ".json"):
+    {"version": 1, "file": ..., "resolution": [x, y],
+     "ids": {"<id>": {"hash": "<id as hex>", "bbox": [xmin, ymin, xmax, ymax],
+                      "pixels": n, "chunks": [[offset, bytes], ...]}, ...}}
+ */
+#pragma once
+
+#ifndef __AutomattesSidecar__
+#define __AutomattesSidecar__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace HA_HDK {
+
+static const char     MatteSidecarMagic[4] = {'A', 'D', 'M', 'S'};
+static const uint32_t MatteSidecarVersion  = 1;
+
+struct MattePixel
+{
+    uint32_t id;
+    int32_t  pixel;     // row major inside of bucket
+    float    coverage;
+};
+
+// ids' coverage of a bucket, pixels are row major starting at (x,y).
+struct MatteBucket
+{
+    int x = 0;
+    int y = 0;
+    int width  = 0;
+    int height = 0;
+    std::vector<MattePixel> pixels;
+};
+
+class MatteSidecar
+{
+public:
+    explicit MatteSidecar(const std::string & filename);
+    ~MatteSidecar();
+
+    bool isOpen() const noexcept { return myFile != nullptr; }
+    // Sorts bucket by id and appends a chunk per id.
+    void push(MatteBucket & bucket);
+    void setImageSize(const int x, const int y) noexcept;
+
+private:
+    struct IdIndex
+    {
+        int bbox[4] = {INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN};
+        uint64_t pixels = 0;
+        std::vector<std::pair<long, uint32_t> > chunks;
+    };
+
+    void writeHeader();
+    void writeManifest() const;
+
+    std::FILE * myFile = nullptr;
+    std::string myFilename;
+    std::mutex  myMutex;
+    std::atomic<int> myResX;
+    std::atomic<int> myResY;
+    std::map<uint32_t, IdIndex> myIndex;
+};
+
+} // end of HA_HDK Space
+
+#endif
@@ -0,0 +1,127 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "AutomattesTrace.hpp"
+
+namespace HA_HDK {
+
+namespace {
+    const char * const tracePath = std::getenv("AUTOMATTES_TRACE");
+    const std::chrono::steady_clock::time_point traceStart = std::chrono::steady_clock::now();
+
+    struct TraceEvent
+    {
+        const char * name;
+        uint64_t start; // ns since library load
+        uint64_t end;
+    };
+
+    // Single writer (owning thread), head is published after the slot is written.
+    static const size_t TraceRingSize = 1 << 14;
+    struct TraceRing
+    {
+        long tid = 0;
+        std::atomic<uint64_t> head{0};
+        TraceEvent events[TraceRingSize];
+    };
+
+    // rings outlive their threads, so dumps may still read them.
+    std::mutex traceMutex;
+    std::vector<std::unique_ptr<TraceRing> > traceRings;
+
+    TraceRing * threadRing()
+    {
+        thread_local TraceRing * ring = nullptr;
+        if (!ring) {
+            std::unique_ptr<TraceRing> fresh(new TraceRing);
+            fresh->tid = syscall(SYS_gettid);
+            std::lock_guard<std::mutex> guard(traceMutex);
+            ring = fresh.get();
+            traceRings.push_back(std::move(fresh));
+        }
+        return ring;
+    }
+
+    thread_local uint64_t firstInsert = 0;
+    thread_local uint64_t lastInsert  = 0;
+}
+
+bool VEX_Trace_enabled() noexcept
+{
+    return tracePath != nullptr;
+}
+
+uint64_t VEX_Trace_now() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceStart).count();
+}
+
+void VEX_Trace_record(const char * name, const uint64_t start, const uint64_t end) noexcept
+{
+    TraceRing * ring = threadRing();
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent & event = ring->events[head & (TraceRingSize - 1)];
+    event.name  = name;
+    event.start = start;
+    event.end   = end;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void VEX_Trace_insert() noexcept
+{
+    if (!tracePath)
+        return;
+    lastInsert = VEX_Trace_now();
+    if (!firstInsert)
+        firstInsert = lastInsert;
+}
+
+void VEX_Trace_flushInserts() noexcept
+{
+    if (!tracePath || !firstInsert)
+        return;
+    VEX_Trace_record("inserts", firstInsert, lastInsert);
+    firstInsert = 0;
+}
+
+void VEX_Trace_dump()
+{
+    if (!tracePath)
+        return;
+    std::FILE * file = std::fopen(tracePath, "w");
+    if (!file) {
+        std::cerr << "Automattes: can't open trace file: " << tracePath << "\n";
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(traceMutex);
+    const long pid = getpid();
+    size_t count = 0;
+    std::fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (size_t r = 0; r < traceRings.size(); ++r) {
+        const TraceRing & ring = *traceRings[r];
+        const uint64_t head  = ring.head.load(std::memory_order_acquire);
+        const uint64_t first = (head > TraceRingSize) ? head - TraceRingSize : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            const TraceEvent & event = ring.events[i & (TraceRingSize - 1)];
+            // chrome wants microseconds
+            std::fprintf(file, "%s\n {\"name\": \"%s\", \"ph\": \"X\", \"pid\": %ld, \"tid\": %ld, "
+                "\"ts\": %.3f, \"dur\": %.3f}", count++ ? "," : "", event.name, pid, ring.tid, 
+                event.start * 1e-3, (event.end - event.start) * 1e-3);
+        }
+    }
+    std::fprintf(file, "\n]}\n");
+    std::fclose(file);
+    std::cout << "Automattes: " << count << " trace events saved to " << tracePath << "\n";
+}
+
+} // end of HA_HDK
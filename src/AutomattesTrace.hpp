@@ -0,0 +1,52 @@
+/*
+ Timeline tracing of store and filter stages.
+
+ Off unless AUTOMATTES_TRACE names an output file. Every thread records
+ complete events into its own ring buffer (oldest events are overwritten),
+ so recording takes no lock. Sessions dump all rings as Chrome trace JSON
+ when they close; open the file in chrome://tracing or Perfetto.
+ */
+#pragma once
+
+#ifndef __AutomattesTrace__
+#define __AutomattesTrace__
+
+#include <cstdint>
+
+namespace HA_HDK {
+
+// true if AUTOMATTES_TRACE was set when the library loaded.
+bool VEX_Trace_enabled() noexcept;
+uint64_t VEX_Trace_now() noexcept;
+// complete event of calling thread, times from VEX_Trace_now().
+void VEX_Trace_record(const char * name, const uint64_t start, const uint64_t end) noexcept;
+// shaders' inserts into current thread store, reported as one span per bucket.
+void VEX_Trace_insert() noexcept;
+void VEX_Trace_flushInserts() noexcept;
+// writes every thread's events to AUTOMATTES_TRACE.
+void VEX_Trace_dump();
+
+// Records enclosing scope, names have to be string literals.
+class TraceScope
+{
+public:
+    explicit TraceScope(const char * name) noexcept
+        : myName(VEX_Trace_enabled() ? name : nullptr)
+        , myStart(myName ? VEX_Trace_now() : 0)
+    {}
+    ~TraceScope()
+    {
+        if (myName)
+            VEX_Trace_record(myName, myStart, VEX_Trace_now());
+    }
+    TraceScope(const TraceScope &) = delete;
+    TraceScope & operator=(const TraceScope &) = delete;
+
+private:
+    const char * myName;
+    uint64_t     myStart;
+};
+
+} // end of HA_HDK Space
+
+#endif
@@ -333,3 +333,236 @@ void MurmurHash3_x64_128 ( const void * key, const int len,
 
 //-----------------------------------------------------------------------------
 
+// Batched MurmurHash3_x86_32 - hashes many keys at once, one key per SIMD
+// lane. Lanes run the block loop in lockstep (a lane whose key ran out of
+// blocks is masked), tail bytes are mixed per lane and the finalization
+// runs in SIMD again. Results are bit-identical to MurmurHash3_x86_32.
+// Blocks are gathered per lane with scalar loads, and these dominate: on
+// scene names (~35 bytes) AVX2 is 1.0-1.25x the scalar batch loop and SSE4.1
+// about even (MurmurHash3Bench), and either may lose on other machines. Most 
+// of the gain over single calls comes from the inlined batch loop, not the 
+// lanes, so the scalar loop is the default and lanes are opt-in.
+
+#include <string.h>
+
+#if !defined(_MSC_VER) && (defined(__x86_64__) || defined(__i386__))
+#define MURMUR_BATCH_SIMD
+#include <immintrin.h>
+#endif
+
+static void MurmurHash3_x86_32_batch_scalar ( const void * const * keys, const int * lens,
+                                              int count, uint32_t seed, uint32_t * out )
+{
+  for(int i = 0; i < count; i++)
+    MurmurHash3_x86_32(keys[i], lens[i], seed, &out[i]);
+}
+
+// block k1 of key at index i, or 0 past its end (masked out anyway)
+FORCE_INLINE uint32_t getlaneblock32 ( const void * key, int nblocks, int i )
+{
+  uint32_t k1 = 0;
+  if(i < nblocks)
+    memcpy(&k1, (const uint8_t*)key + i*4, 4);
+  return k1;
+}
+
+FORCE_INLINE uint32_t tail32 ( const void * key, int len, uint32_t h1 )
+{
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+  const uint8_t * tail = (const uint8_t*)key + (len & ~3);
+
+  uint32_t k1 = 0;
+
+  switch(len & 3)
+  {
+  case 3: k1 ^= tail[2] << 16;
+          // fall through
+  case 2: k1 ^= tail[1] << 8;
+          // fall through
+  case 1: k1 ^= tail[0];
+          k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
+  };
+
+  return h1 ^ len;
+}
+
+#ifdef MURMUR_BATCH_SIMD
+
+#define MURMUR_LANES_SSE  4
+#define MURMUR_LANES_AVX2 8
+
+__attribute__((target("sse4.1")))
+static void MurmurHash3_x86_32_batch_sse41 ( const void * const * keys, const int * lens,
+                                             int count, uint32_t seed, uint32_t * out )
+{
+  const __m128i c1 = _mm_set1_epi32(0xcc9e2d51);
+  const __m128i c2 = _mm_set1_epi32(0x1b873593);
+  const __m128i c3 = _mm_set1_epi32(0xe6546b64);
+  const __m128i f1 = _mm_set1_epi32(0x85ebca6b);
+  const __m128i f2 = _mm_set1_epi32(0xc2b2ae35);
+
+  int first = 0;
+  for(; first + MURMUR_LANES_SSE <= count; first += MURMUR_LANES_SSE)
+  {
+    int nblocks[MURMUR_LANES_SSE];
+    int maxblocks = 0;
+    for(int l = 0; l < MURMUR_LANES_SSE; l++)
+    {
+      nblocks[l] = lens[first+l] / 4;
+      maxblocks = nblocks[l] > maxblocks ? nblocks[l] : maxblocks;
+    }
+    const __m128i nb = _mm_loadu_si128((const __m128i*)nblocks);
+
+    __m128i h1 = _mm_set1_epi32(seed);
+
+    for(int i = 0; i < maxblocks; i++)
+    {
+      __m128i k1 = _mm_setr_epi32(
+        getlaneblock32(keys[first+0], nblocks[0], i),
+        getlaneblock32(keys[first+1], nblocks[1], i),
+        getlaneblock32(keys[first+2], nblocks[2], i),
+        getlaneblock32(keys[first+3], nblocks[3], i));
+
+      k1 = _mm_mullo_epi32(k1, c1);
+      k1 = _mm_or_si128(_mm_slli_epi32(k1, 15), _mm_srli_epi32(k1, 17));
+      k1 = _mm_mullo_epi32(k1, c2);
+
+      __m128i h = _mm_xor_si128(h1, k1);
+      h = _mm_or_si128(_mm_slli_epi32(h, 13), _mm_srli_epi32(h, 19));
+      h = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h, 2), h), c3);
+
+      const __m128i active = _mm_cmpgt_epi32(nb, _mm_set1_epi32(i));
+      h1 = _mm_blendv_epi8(h1, h, active);
+    }
+
+    uint32_t hs[MURMUR_LANES_SSE];
+    _mm_storeu_si128((__m128i*)hs, h1);
+    for(int l = 0; l < MURMUR_LANES_SSE; l++)
+      hs[l] = tail32(keys[first+l], lens[first+l], hs[l]);
+    h1 = _mm_loadu_si128((const __m128i*)hs);
+
+    h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+    h1 = _mm_mullo_epi32(h1, f1);
+    h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 13));
+    h1 = _mm_mullo_epi32(h1, f2);
+    h1 = _mm_xor_si128(h1, _mm_srli_epi32(h1, 16));
+
+    _mm_storeu_si128((__m128i*)&out[first], h1);
+  }
+
+  MurmurHash3_x86_32_batch_scalar(keys + first, lens + first, count - first, seed, out + first);
+}
+
+__attribute__((target("avx2")))
+static void MurmurHash3_x86_32_batch_avx2 ( const void * const * keys, const int * lens,
+                                            int count, uint32_t seed, uint32_t * out )
+{
+  const __m256i c1 = _mm256_set1_epi32(0xcc9e2d51);
+  const __m256i c2 = _mm256_set1_epi32(0x1b873593);
+  const __m256i c3 = _mm256_set1_epi32(0xe6546b64);
+  const __m256i f1 = _mm256_set1_epi32(0x85ebca6b);
+  const __m256i f2 = _mm256_set1_epi32(0xc2b2ae35);
+
+  int first = 0;
+  for(; first + MURMUR_LANES_AVX2 <= count; first += MURMUR_LANES_AVX2)
+  {
+    int nblocks[MURMUR_LANES_AVX2];
+    int maxblocks = 0;
+    for(int l = 0; l < MURMUR_LANES_AVX2; l++)
+    {
+      nblocks[l] = lens[first+l] / 4;
+      maxblocks = nblocks[l] > maxblocks ? nblocks[l] : maxblocks;
+    }
+    const __m256i nb = _mm256_loadu_si256((const __m256i*)nblocks);
+
+    __m256i h1 = _mm256_set1_epi32(seed);
+
+    for(int i = 0; i < maxblocks; i++)
+    {
+      __m256i k1 = _mm256_setr_epi32(
+        getlaneblock32(keys[first+0], nblocks[0], i),
+        getlaneblock32(keys[first+1], nblocks[1], i),
+        getlaneblock32(keys[first+2], nblocks[2], i),
+        getlaneblock32(keys[first+3], nblocks[3], i),
+        getlaneblock32(keys[first+4], nblocks[4], i),
+        getlaneblock32(keys[first+5], nblocks[5], i),
+        getlaneblock32(keys[first+6], nblocks[6], i),
+        getlaneblock32(keys[first+7], nblocks[7], i));
+
+      k1 = _mm256_mullo_epi32(k1, c1);
+      k1 = _mm256_or_si256(_mm256_slli_epi32(k1, 15), _mm256_srli_epi32(k1, 17));
+      k1 = _mm256_mullo_epi32(k1, c2);
+
+      __m256i h = _mm256_xor_si256(h1, k1);
+      h = _mm256_or_si256(_mm256_slli_epi32(h, 13), _mm256_srli_epi32(h, 19));
+      h = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(h, 2), h), c3);
+
+      const __m256i active = _mm256_cmpgt_epi32(nb, _mm256_set1_epi32(i));
+      h1 = _mm256_blendv_epi8(h1, h, active);
+    }
+
+    uint32_t hs[MURMUR_LANES_AVX2];
+    _mm256_storeu_si256((__m256i*)hs, h1);
+    for(int l = 0; l < MURMUR_LANES_AVX2; l++)
+      hs[l] = tail32(keys[first+l], lens[first+l], hs[l]);
+    h1 = _mm256_loadu_si256((const __m256i*)hs);
+
+    h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+    h1 = _mm256_mullo_epi32(h1, f1);
+    h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 13));
+    h1 = _mm256_mullo_epi32(h1, f2);
+    h1 = _mm256_xor_si256(h1, _mm256_srli_epi32(h1, 16));
+
+    _mm256_storeu_si256((__m256i*)&out[first], h1);
+  }
+
+  MurmurHash3_x86_32_batch_sse41(keys + first, lens + first, count - first, seed, out + first);
+}
+
+#endif // MURMUR_BATCH_SIMD
+
+//-----------------------------------------------------------------------------
+// Runtime dispatch, resolved once on first use
+
+typedef void (*MurmurBatchFn) ( const void * const *, const int *, int, uint32_t, uint32_t * );
+
+static MurmurBatchFn MurmurHash3_x86_32_batch_resolve ( MurmurBatchISA isa )
+{
+#ifdef MURMUR_BATCH_SIMD
+  __builtin_cpu_init();
+  if(isa >= MURMUR_BATCH_AVX2 && __builtin_cpu_supports("avx2"))
+    return MurmurHash3_x86_32_batch_avx2;
+  if(isa >= MURMUR_BATCH_SSE41 && __builtin_cpu_supports("sse4.1"))
+    return MurmurHash3_x86_32_batch_sse41;
+#endif
+  return MurmurHash3_x86_32_batch_scalar;
+}
+
+MurmurBatchISA MurmurHash3_x86_32_batch_isa ( void )
+{
+  const MurmurBatchFn fn = MurmurHash3_x86_32_batch_resolve(MURMUR_BATCH_AVX2);
+#ifdef MURMUR_BATCH_SIMD
+  if(fn == MurmurHash3_x86_32_batch_avx2)  return MURMUR_BATCH_AVX2;
+  if(fn == MurmurHash3_x86_32_batch_sse41) return MURMUR_BATCH_SSE41;
+#endif
+  return MURMUR_BATCH_SCALAR;
+}
+
+void MurmurHash3_x86_32_batch_with ( MurmurBatchISA isa, const void * const * keys,
+                                     const int * lens, int count, uint32_t seed, uint32_t * out )
+{
+  MurmurHash3_x86_32_batch_resolve(isa)(keys, lens, count, seed, out);
+}
+
+void MurmurHash3_x86_32_batch ( const void * const * keys, const int * lens,
+                                int count, uint32_t seed, uint32_t * out )
+{
+  // AUTOMATTES_MURMUR_SIMD=1 lets the widest lanes the CPU has run the batch.
+  static const char * const simd = getenv("AUTOMATTES_MURMUR_SIMD");
+  static const MurmurBatchFn fn = MurmurHash3_x86_32_batch_resolve(
+    (simd && *simd && *simd != '0') ? MURMUR_BATCH_AVX2 : MURMUR_BATCH_SCALAR);
+  fn(keys, lens, count, seed, out);
+}
+
+//-----------------------------------------------------------------------------
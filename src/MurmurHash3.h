@@ -32,6 +32,23 @@ void MurmurHash3_x86_128 ( const void * key, int len, uint32_t seed, void * out
 
 void MurmurHash3_x64_128 ( const void * key, int len, uint32_t seed, void * out );
 
+//-----------------------------------------------------------------------------
+// Batched MurmurHash3_x86_32: hashes count keys into out[count] in a scalar
+// loop, or in SSE4.1/AVX2 lanes the CPU has when AUTOMATTES_MURMUR_SIMD=1.
+// Results match MurmurHash3_x86_32.
+
+enum MurmurBatchISA { MURMUR_BATCH_SCALAR, MURMUR_BATCH_SSE41, MURMUR_BATCH_AVX2 };
+
+void MurmurHash3_x86_32_batch ( const void * const * keys, const int * lens,
+                                int count, uint32_t seed, uint32_t * out );
+
+// best instruction set available on this machine.
+MurmurBatchISA MurmurHash3_x86_32_batch_isa ( void );
+
+// same as above, limited to isa (or less if CPU lacks it), for testing.
+void MurmurHash3_x86_32_batch_with ( MurmurBatchISA isa, const void * const * keys,
+                                     const int * lens, int count, uint32_t seed, uint32_t * out );
+
 //-----------------------------------------------------------------------------
 
 #endif // _MURMURHASH3_H_
@@ -0,0 +1,97 @@
+/*
+ Micro-benchmark of batched MurmurHash3_x86_32 against the scalar one.
+ Hashes a table of scene like names (object paths of mixed length) the way
+ manifest and id table generation does, checks every instruction set gives
+ bit-identical hashes and reports throughput.
+
+ SIMD lanes are compared against the scalar batch path, which runs the same
+ loop without vectors; the gain over it is what the lanes buy. Renders use
+ the scalar path unless AUTOMATTES_MURMUR_SIMD=1, run this to decide. The "single"
+ line is one out of line MurmurHash3_x86_32() call per name, for reference.
+
+ usage: MurmurHash3Bench [names] [repeats]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "MurmurHash3.h"
+
+namespace {
+
+const char * isaName(const MurmurBatchISA isa)
+{
+    switch (isa) {
+        case MURMUR_BATCH_AVX2:  return "avx2";
+        case MURMUR_BATCH_SSE41: return "sse4.1";
+        default:                 return "scalar";
+    }
+}
+
+double seconds(const std::chrono::steady_clock::time_point & start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    const int count   = (argc > 1) ? std::atoi(argv[1]) : 500000;
+    const int repeats = (argc > 2) ? std::atoi(argv[2]) : 20;
+
+    std::vector<std::string> names(count);
+    std::vector<const void*> keys(count);
+    std::vector<int> lens(count);
+    size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+        char name[128];
+        std::snprintf(name, sizeof(name), "/obj/asset_%d/geo%d/%s", i % 977, i, 
+            (i & 1) ? "shape" : "instance_pieces");
+        names[i] = name;
+        keys[i]  = names[i].c_str();
+        lens[i]  = static_cast<int>(names[i].size());
+        bytes   += names[i].size();
+    }
+
+    std::vector<uint32_t> reference(count);
+    std::vector<uint32_t> hashes(count);
+
+    // warm up caches before the timed runs.
+    for (int i = 0; i < count; ++i)
+        MurmurHash3_x86_32(keys[i], lens[i], 0, &reference[i]);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r)
+        for (int i = 0; i < count; ++i)
+            MurmurHash3_x86_32(keys[i], lens[i], 0, &reference[i]);
+    const double scalar = seconds(start);
+
+    std::printf("%d names, %.1f bytes avg, %d repeats, best isa: %s\n", count, 
+        double(bytes)/count, repeats, isaName(MurmurHash3_x86_32_batch_isa()));
+    std::printf("%-8s %10.2f Mhash/s\n", "single", double(count)*repeats/scalar*1e-6);
+
+    int failed = 0;
+    double scalarbatch = 0.;
+    const MurmurBatchISA isas[3] = {MURMUR_BATCH_SCALAR, MURMUR_BATCH_SSE41, MURMUR_BATCH_AVX2};
+    for (int k = 0; k < 3; ++k) {
+        if (isas[k] > MurmurHash3_x86_32_batch_isa())
+            continue;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; ++r)
+            MurmurHash3_x86_32_batch_with(isas[k], &keys[0], &lens[0], count, 0, &hashes[0]);
+        const double batch = seconds(start);
+        if (isas[k] == MURMUR_BATCH_SCALAR)
+            scalarbatch = batch;
+
+        const bool same = std::memcmp(&hashes[0], &reference[0], count*sizeof(uint32_t)) == 0;
+        failed += !same;
+        std::printf("%-8s %10.2f Mhash/s  x%.2f vs scalar batch  %s\n", isaName(isas[k]), 
+            double(count)*repeats/batch*1e-6, scalarbatch/batch, same ? "ok" : "MISMATCH");
+    }
+
+    return failed;
+}
@@ -8,6 +8,10 @@
 #include <functional>
 #include <memory>
 #include <map>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
 #include <tbb/concurrent_vector.h> 
 
 #include <UT/UT_DSOVersion.h>
@@ -29,22 +33,6 @@ namespace HA_HDK {
 
 static const uint32_t background = 2287214504; // precomputed from  MurmurHash3_x86_32("_ray_fog_object_internal_xyzzy", ...);
 
-// From Cryptomatte specification[1]
-float hash_to_float(uint32_t hash)
-{
-    uint32_t mantissa = hash & (( 1 << 23) - 1);
-    uint32_t exponent = (hash >> 23) & ((1 << 8) - 1);
-    exponent = std::max(exponent, (uint32_t) 1);
-    exponent = std::min(exponent, (uint32_t) 254);
-    exponent = exponent << 23;
-    uint32_t sign = (hash >> 31);
-    sign = sign << 31;
-    uint32_t float_bits = sign | exponent | mantissa;
-    float f;
-    std::memcpy(&f, &float_bits, 4);
-    return f;
-}
-
 static void
 murmurhash3F(int argc,  void *argv[], void *data)
 {
@@ -65,15 +53,56 @@ murmurhash3I(int argc,  void *argv[], void *data)
     *result = (m3hash != background) ? m3hash : 0;
 }
 
+// Handle returned to shaders is the session's, -1 when no filter opened it
+// (i.e. automatte filter isn't used by this render).
 static void vex_store_open(int argc, void *argv[], void *data)
 {
     int            *result    = (int*)            argv[0];
-    const char     *channel   = (const char*)     argv[1];
+    const char     *session   = (const char*)     argv[1];
 
+    result[0] = VEX_Session_find(session);
+    AutomatteSession * store = VEX_Session_get(result[0]);
+    if (!store)
+        return;
     // const int thread_id = UT_Thread::getMyThreadId();
     const int thread_id = SYSgetSTID();
-    result[0] = VEX_Samples_create(thread_id);
+    store->createStore(thread_id);
+}
+
+static void vex_store_open_res(int argc, void *argv[], void *data)
+{
+    int            *result    = (int*)            argv[0];
+    const char     *session   = (const char*)     argv[1];
+    const VEXvec3  *res       = (const VEXvec3*)  argv[2];
+
+    result[0] = VEX_Session_find(session);
+    AutomatteSession * store = VEX_Session_get(result[0]);
+    if (!store)
+        return;
+    // image resolution lets the filter place deep buckets in pixel space.
+    store->setImageSize(static_cast<int>(res->x()), static_cast<int>(res->y()));
+    const int thread_id = SYSgetSTID();
+    store->createStore(thread_id);
+}
+
+// Crop split renders also hand over the crop region, filter's -b files mark
+// seams from it.
+static void vex_store_open_crop(int argc, void *argv[], void *data)
+{
+    int            *result    = (int*)            argv[0];
+    const char     *session   = (const char*)     argv[1];
+    const VEXvec3  *res       = (const VEXvec3*)  argv[2];
+    const VEXvec4  *crop      = (const VEXvec4*)  argv[3];
 
+    result[0] = VEX_Session_find(session);
+    AutomatteSession * store = VEX_Session_get(result[0]);
+    if (!store)
+        return;
+    store->setImageSize(static_cast<int>(res->x()), static_cast<int>(res->y()));
+    const CropWindow window = {crop->x(), crop->y(), crop->z(), crop->w()};
+    store->setCrop(window);
+    const int thread_id = SYSgetSTID();
+    store->createStore(thread_id);
 }
 
 static void vex_store_save(int argc, void *argv[], void *data)
@@ -81,14 +110,123 @@ static void vex_store_save(int argc, void *argv[], void *data)
           VEXint   *result = (      VEXint* )  argv[0];
     const VEXint   *handle = (const VEXint* )  argv[1];
     const VEXvec3  *P      = (const VEXvec3*)  argv[2];
-    const VEXfloat *id     = (const VEXfloat*) argv[3];
+    const VEXint   *id     = (const VEXint*  ) argv[3];
     const VEXfloat *Af     = (const VEXfloat*) argv[4];
 
+    AutomatteSession * store = VEX_Session_get(*handle);
+    if (!store) {
+        *result = 0;
+        return;
+    }
     // const int thread_id = UT_Thread::getMyThreadId();
     const int thread_id = SYSgetSTID();
-    const float thf = static_cast<float>(thread_id);
-    Sample sample = {P->x(), P->y(), P->z(), *id, *Af, thf};
-    *result = VEX_Samples_insert(*handle, sample);
+    const uint32_t _id  = static_cast<uint32_t>(*id);
+    const uint32_t thid = static_cast<uint32_t>(thread_id);
+    Sample sample = {P->x(), P->y(), P->z(), _id, *Af, thid};
+    *result = store->insert(thread_id, sample);
+}
+
+static void vex_store_register(int argc, void *argv[], void *data)
+{
+          VEXint   *result = (      VEXint* )  argv[0];
+    const VEXint   *handle = (const VEXint* )  argv[1];
+    const VEXint   *id     = (const VEXint* )  argv[2];
+    const char     *name   = (const char*   )  argv[3];
+    const char     *groups = (const char*   )  argv[4];
+
+    AutomatteSession * store = VEX_Session_get(*handle);
+    if (!store) {
+        *result = 0;
+        return;
+    }
+    // cheap lookup once object is known, hashing happens once per render.
+    *result = store->registerObject(static_cast<uint32_t>(*id), name, groups);
+}
+
+static void vex_store_register_material(int argc, void *argv[], void *data)
+{
+          VEXint   *result   = (      VEXint* )  argv[0];
+    const VEXint   *handle   = (const VEXint* )  argv[1];
+    const VEXint   *id       = (const VEXint* )  argv[2];
+    const char     *name     = (const char*   )  argv[3];
+    const char     *groups   = (const char*   )  argv[4];
+    const char     *material = (const char*   )  argv[5];
+
+    AutomatteSession * store = VEX_Session_get(*handle);
+    if (!store) {
+        *result = 0;
+        return;
+    }
+    *result = store->registerObject(static_cast<uint32_t>(*id), name, groups, material);
+}
+
+// Material ids travel through a float channel, keep them exact.
+static inline float material_to_float(const uint32_t hash)
+{
+    return static_cast<float>(hash & 0xffffff);
+}
+
+// Everything a fog sample needs in one call: saves (ndc.x, ndc.y, Pz), id and
+// opacity and returns exported objectid. Objects' material ids are cached per
+// thread, so only the first sample of an object returns 0 and asks shader to
+// vexstoreregister() it; -1 means no filter opened the session.
+static void vex_store_record(int argc, void *argv[], void *data)
+{
+          VEXint   *result   = (      VEXint* )  argv[0];
+          VEXvec4  *objectid = (      VEXvec4*)  argv[1];
+    const char     *session  = (const char*   )  argv[2];
+    const VEXint   *id       = (const VEXint* )  argv[3];
+    const VEXvec3  *P        = (const VEXvec3*)  argv[4];
+    const VEXfloat *Af       = (const VEXfloat*) argv[5];
+
+    const uint32_t _id = static_cast<uint32_t>(*id);
+    objectid->assign(P->x(), static_cast<float>(*id), 0.f, P->y());
+
+    const int handle = VEX_Session_find(session);
+    AutomatteSession * store = VEX_Session_get(handle);
+    if (!store) {
+        *result = -1;
+        return;
+    }
+
+    // handles are reused by later sessions, epoch tells when cache went stale.
+    thread_local int cachedEpoch  = -1;
+    thread_local int cachedHandle = -1;
+    thread_local std::unordered_map<uint32_t, float> materials;
+    thread_local uint32_t lastId = 0;
+    thread_local float    lastMaterial = -1.f;
+
+    const int thread_id = SYSgetSTID();
+    const int epoch = VEX_Session_epoch();
+    if (epoch != cachedEpoch || handle != cachedHandle) {
+        materials.clear();
+        lastMaterial = -1.f;
+        cachedEpoch  = epoch;
+        cachedHandle = handle;
+    }
+
+    if (lastMaterial < 0.f || lastId != _id) {
+        std::unordered_map<uint32_t, float>::const_iterator it = materials.find(_id);
+        if (it != materials.end()) {
+            lastMaterial = it->second;
+        } else {
+            uint32_t material = 0;
+            if (!store->findObject(_id, material)) {
+                *result = 0;
+                return;
+            }
+            // first sample of a known object on this thread.
+            store->createStore(thread_id);
+            lastMaterial = material_to_float(material);
+            materials[_id] = lastMaterial;
+        }
+        lastId = _id;
+    }
+
+    const uint32_t thid = static_cast<uint32_t>(thread_id);
+    Sample sample = {P->x(), P->y(), P->z(), _id, *Af, thid};
+    *result = store->insert(thread_id, sample);
+    objectid->z() = lastMaterial * SYSmin(1, *result);
 }
 
 }// end of HA_HDK namespace
@@ -125,7 +263,42 @@ newVEXOp(void *)
         NULL,           // cleanup function
         VEX_OPTIMIZE_2 // Optimization level
         );
-     new VEX_VexOp("vexstoresave@&IIVFF",  // Signature
+    new VEX_VexOp("vexstoreopen@&ISV",  // Signature
+        vex_store_open_res,  // Evaluator
+        VEX_ALL_CONTEXT,    // Context mask
+        NULL,           // init function
+        NULL,           // cleanup function
+        VEX_OPTIMIZE_2 // Optimization level
+        );
+    new VEX_VexOp("vexstoreopen@&ISVP",  // Signature
+        vex_store_open_crop, // Evaluator
+        VEX_ALL_CONTEXT,    // Context mask
+        NULL,           // init function
+        NULL,           // cleanup function
+        VEX_OPTIMIZE_2 // Optimization level
+        );
+    new VEX_VexOp("vexstoreregister@&IIISS",  // Signature
+        vex_store_register,  // Evaluator
+        VEX_ALL_CONTEXT,    // Context mask
+        NULL,           // init function
+        NULL,           // cleanup function
+        VEX_OPTIMIZE_2 // Optimization level
+        );
+    new VEX_VexOp("vexstoreregister@&IIISSS",  // Signature
+        vex_store_register_material,  // Evaluator
+        VEX_ALL_CONTEXT,    // Context mask
+        NULL,           // init function
+        NULL,           // cleanup function
+        VEX_OPTIMIZE_2 // Optimization level
+        );
+    new VEX_VexOp("vexstorerecord@&I&PSIVF",  // Signature
+        vex_store_record,    // Evaluator
+        VEX_ALL_CONTEXT,    // Context mask
+        NULL,           // init function
+        NULL,           // cleanup function
+        VEX_OPTIMIZE_2, // Optimization level
+        true);
+     new VEX_VexOp("vexstoresave@&IIVIF",  // Signature
         vex_store_save,      // Evaluator
         VEX_ALL_CONTEXT,    // Context mask
         NULL,           // init function
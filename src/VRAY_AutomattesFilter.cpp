@@ -21,11 +21,14 @@
 #include <map>
 #include <memory>
 #include <limits>
+#include <cstring>
+#include <sstream>
  #include <cmath>
 
 //OWN
 #include "VRAY_AutomattesFilter.hpp"
 #include "AutomattesHelper.hpp"
+#include "AutomattesTrace.hpp"
 
 using namespace HA_HDK;
 
@@ -37,6 +40,43 @@ allocPixelFilter(const char *name)
     return new VRAY_AutomatteFilter();
 }
 
+TileOutputs::TileOutputs(const std::shared_ptr<DeepIdWriter> & deepwriter, 
+    const std::shared_ptr<MatteSidecar> & sidecar, const std::shared_ptr<CoverageCensus> & census)
+    : myDeepWriter(deepwriter)
+    , myMatteSidecar(sidecar)
+    , myCensus(census)
+{
+}
+
+TileOutputs::~TileOutputs()
+{
+    for (auto it = myTiles.begin(); it != myTiles.end(); ++it) {
+        Tile & tile = it->second;
+        if (myDeepWriter)
+            myDeepWriter->push(std::move(tile.deep));
+        if (myMatteSidecar)
+            myMatteSidecar->push(tile.matte);
+        if (myCensus)
+            myCensus->push(tile.census);
+    }
+}
+
+void TileOutputs::set(const TileKey key, const uint32_t generation, DeepBucket * deep, 
+    const MatteBucket * matte, const CensusBucket * census)
+{
+    tbb::concurrent_hash_map<TileKey, Tile>::accessor wa;
+    const bool fresh = myTiles.insert(wa, key);
+    if (!fresh && wa->second.generation > generation)
+        return;
+    wa->second.generation = generation;
+    if (deep)
+        wa->second.deep = std::move(*deep);
+    if (matte)
+        wa->second.matte = *matte;
+    if (census)
+        wa->second.census = *census;
+}
+
 
 VRAY_AutomatteFilter::VRAY_AutomatteFilter()
     : mySamplesPerPixelX(1) 
@@ -46,11 +86,25 @@ VRAY_AutomatteFilter::VRAY_AutomatteFilter()
     , myGaussianAlpha(1)
     , myGaussianExp(0)
     , myRank(0)
+    , myDiagnostic(0)
+    , myPacked(0)
+    , myPlaneKind(-1)
     , myHashTypeName("crypto")
     , myHashType(CRYPTO)
     , myIdTypeName("object")
     , myIdType(OBJECT)
+    , myDeepFileName("")
+    , myProgressive(0)
+    , myPartialFileName("")
+    , myMatteFileName("")
+    , myCensusFileName("")
+    , mySessionName("automatte")
+    , mySampleSourceName("vex")
+    , mySampleSource(VEXSTORE)
+    , myFootOffsetX(0)
+    , myFootOffsetY(0)
 {
+    pickKernel();
 
 }
 
@@ -62,7 +116,7 @@ VRAY_AutomatteFilter::~VRAY_AutomatteFilter()
     GU_Detail gdp, gdp2;
     long npoints = 0;
     long npoints2 = 0;
-    VEX_Samples  * samples = VEX_Samples_get();
+    VEX_Samples  * samples = mySession->getSamples();
     // UT_PointGrid<UT_Vector3Point> pixelgrid(nullptr);
     
 
@@ -94,7 +148,7 @@ VRAY_AutomatteFilter::~VRAY_AutomatteFilter()
                 // positions.bumpSize(size);
                 // indices.bumpSize(size);
                 const Sample & sample = bucket.at(i);
-                const UT_Vector3 pos = {sample[0], sample[1], 0.f};
+                const UT_Vector3 pos = {sample.x, sample.y, 0.f};
                 GA_Offset ptoff = gdp.appendPoint();
                 gdp.setPos3(ptoff, pos);
                 bucket_min = SYSmin(pos, bucket_min);
@@ -134,7 +188,7 @@ VRAY_AutomatteFilter::~VRAY_AutomatteFilter()
                         const size_t idx = iter.getValue();
                         // UT_ASSERT(idx < bucket.size());
                         const Sample & sample = bucket.at(idx); 
-                        const UT_Vector3 pos = {sample[0], sample[1], sample[2]};
+                        const UT_Vector3 pos = {sample.x, sample.y, sample.z};
                         GA_Offset ptoff = gdp2.appendPoint();
                         gdp2.setPos3(ptoff, pos);
                     }
@@ -168,20 +222,80 @@ VRAY_AutomatteFilter::setArgs(int argc, const char *const argv[])
 {
     UT_Args args;
     args.initialize(argc, argv);
-    args.stripOptions("w:r:i:h:");
+    args.stripOptions("w:r:i:h:f:p:s:v:b:m:c:d:k:");
 
     if (args.found('w')) { myFilterWidth = args.fargp('w'); }
     if (args.found('r')) { myRank        = args.fargp('r'); }
+    if (args.found('d')) { myDiagnostic  = args.iargp('d'); }
+    if (args.found('k')) { myPacked      = args.iargp('k'); }
 
     // hash type
     if (args.found('h')) { 
         myHashTypeName = args.argp('h'); 
         if (std::string(myHashTypeName).compare("mantra") == 0)
             myHashType = Automatte_HashType::MANTRA;
+        else if (std::string(myHashTypeName).compare("deep") == 0)
+            myHashType = Automatte_HashType::DEEP;
          else 
             myHashType = Automatte_HashType::CRYPTO;
     }
 
+    // sample source
+    if (args.found('v')) {
+        mySampleSourceName = args.argp('v');
+        if (std::string(mySampleSourceName).compare("native") == 0)
+            mySampleSource = Automatte_SampleSource::NATIVE;
+        else
+            mySampleSource = Automatte_SampleSource::VEXSTORE;
+    }
+
+    // session shared with shaders saving samples for this render.
+    if (args.found('s')) { mySessionName = args.argp('s'); }
+    mySession = VEX_Session_acquire(mySessionName);
+
+    // deep id file, no default: renders would overwrite each other's in cwd.
+    if (args.found('f')) { myDeepFileName = args.argp('f'); }
+    if (myHashType == DEEP && !*myDeepFileName) {
+        std::cerr << "Automattes: -h deep needs a file (-f), using crypto hash\n";
+        myHashType = Automatte_HashType::CRYPTO;
+    }
+
+    // partial file of a crop split render
+    if (args.found('b')) { myPartialFileName = args.argp('b'); }
+
+    // sparse mattes, only rank planes gather full id lists.
+    if (args.found('m')) {
+        myMatteFileName = args.argp('m');
+        if (myRank == 0)
+            std::cerr << "Automattes: -m needs a rank plane (-r 1..n), ignoring " 
+                << myMatteFileName << "\n";
+        else
+            myMatteSidecar = std::make_shared<MatteSidecar>(myMatteFileName);
+    }
+
+    // visible coverage census, as sidecar it needs full id lists.
+    if (args.found('c')) {
+        myCensusFileName = args.argp('c');
+        if (myRank == 0)
+            std::cerr << "Automattes: -c needs a rank plane (-r 1..n), ignoring " 
+                << myCensusFileName << "\n";
+        else
+            myCensus = std::make_shared<CoverageCensus>(myCensusFileName);
+    }
+
+    // progressive, setArgs marks start of a (re)render, so drop older passes.
+    if (args.found('p')) { myProgressive = args.iargp('p'); }
+    if (myProgressive) {
+        myTileCache = std::make_shared<TileCache>();
+        if (mySession)
+            mySession->resetTiles();
+        if (*myPartialFileName) {
+            std::cerr << "Automattes: -b is for final crop renders, ignoring " 
+                << myPartialFileName << " with -p\n";
+            myPartialFileName = "";
+        }
+    }
+
     // id type
     if (args.found('i')) { 
         myIdTypeName  = args.argp('i');
@@ -195,6 +309,51 @@ VRAY_AutomatteFilter::setArgs(int argc, const char *const argv[])
             myIdType = Automatte_IdType::GROUP;
     }
 
+    // packed pairs keep 16 bits of an id, enough for object ids only: 
+    // hashed ones (assets, materials, groups) would collide.
+    if (myPacked && myRank > 0 && myIdType != Automatte_IdType::OBJECT) {
+        std::cerr << "Automattes: -k needs object ids, " << myIdTypeName 
+            << " ids are hashed, using full rank planes\n";
+        myPacked = 0;
+    }
+
+    pickKernel();
+    if (!mySession)
+        return;
+
+    // Planes of one kind see the same ids per pixel: other id types, hashes, 
+    // sources or footprints hold other ids.
+    static const char * hashnames[]   = {"mantra", "crypto", "deep"};
+    static const char * idnames[]     = {"asset", "object", "material", "group"};
+    static const char * sourcenames[] = {"native", "vex"};
+    std::ostringstream kind;
+    kind << idnames[myIdType] << " ids, " << hashnames[myHashType] << " hash, " 
+        << sourcenames[mySampleSource] << " samples, width " << myFilterWidth;
+
+    // Rank planes compare ids per pixel with planes of same kind (and packing) only.
+    if (myRank > 0 && !myDiagnostic)
+        myPlaneKind = mySession->registerPlane(kind.str() + ((myPacked) ? ", packed" : ""));
+
+    // Id files are written by session's first plane naming them, other planes
+    // of its kind would write same lists again.
+    auto idfile = [&](const char * filename, const DeepIdFormat format) {
+        std::string owner = kind.str();
+        std::shared_ptr<DeepIdWriter> writer = mySession->fileWriter<DeepIdWriter>(filename, 
+            owner, [&]() { return std::make_shared<DeepIdWriter>(filename, 64, format); });
+        if (!writer && owner != kind.str())
+            std::cerr << "Automattes: " << mySessionName << ": " << filename 
+                << " is written by a plane of " << owner << ", ignoring it for " 
+                << kind.str() << "\n";
+        return writer;
+    };
+    if (myHashType == DEEP)
+        myDeepWriter = idfile(myDeepFileName, DEEPID_FILE);
+    if (*myPartialFileName)
+        myPartialWriter = idfile(myPartialFileName, PARTIAL_FILE);
+
+    // passes refilter tiles, side outputs keep their latest one.
+    if (myProgressive && (myDeepWriter || myMatteSidecar || myCensus))
+        myTileOutputs = std::make_shared<TileOutputs>(myDeepWriter, myMatteSidecar, myCensus);
 }
 
 void
@@ -219,17 +378,203 @@ VRAY_AutomatteFilter::addNeededSpecialChannels(VRAY_Imager &imager)
 }
 
 namespace {
+    bool compareDeepEntry(const DeepEntry & a, const DeepEntry & b)
+    {
+        return a.id < b.id;
+    }
+
+    void appendDeepPixel(DeepBucket & bucket, const int index, 
+        DeepPixel & pixel, const float norm)
+    {
+        std::sort(pixel.begin(), pixel.end(), compareDeepEntry);
+        bucket.counts[index] = pixel.size();
+        DeepPixel::const_iterator it(pixel.begin());
+        for(; it != pixel.end(); ++it) {
+            bucket.ids.push_back(it->id);
+            bucket.coverage.push_back(it->sample.coverage / norm);
+            bucket.depth.push_back(it->sample.depth);
+        }
+    }
+
+    void appendMattePixel(MatteBucket & bucket, const int index, 
+        const IdCoverageArray & ids, const float norm)
+    {
+        const size_t size = ids.size();
+        for (size_t i = 0; i < size; ++i) {
+            if (ids[i].coverage <= 0.f)
+                continue;
+            const MattePixel pixel = {ids[i].id, index, ids[i].coverage / norm};
+            bucket.pixels.push_back(pixel);
+        }
+    }
+
+    void appendCensusPixel(CensusBucket & bucket, const int x, const int y, 
+        const IdCoverageArray & ids, const float norm)
+    {
+        const size_t size = ids.size();
+        for (size_t i = 0; i < size; ++i) {
+            if (ids[i].coverage > 0.f)
+                bucket.add(ids[i].id, x, y, ids[i].coverage / norm);
+        }
+    }
+
+    // subpixel resolved once per bucket: its samples merged per id.
+    struct ResolvedId
+    {
+        PaletteSlot slot; // bucket's palette
+        float coverage; // sum of samples' opacity
+        float depth;    // nearest sample
+    };
+
+    struct ResolvedSubpixel
+    {
+        int first   = 0; // ids in the resolved vector
+        int count   = 0;
+        int samples = 1; // filter norm counts samples, not ids
+        int lookups = 0; // grid search expansions
+        float color[3] = {0.f, 0.f, 0.f}; // false colors (PREVIEW)
+    };
+
+    void mergeResolvedId(std::vector<ResolvedId> & ids, const size_t first, 
+        const PaletteSlot slot, const float coverage, const float depth)
+    {
+        const size_t size = ids.size();
+        for (size_t i = first; i < size; ++i) {
+            if (ids[i].slot == slot) {
+                ids[i].coverage += coverage;
+                ids[i].depth = SYSmin(ids[i].depth, depth);
+                return;
+            }
+        }
+        const ResolvedId entry = {slot, coverage, depth};
+        ids.push_back(entry);
+    }
+
+    template<typename T>
+    size_t capacityBytes(const std::vector<T> & array)
+    {
+        return array.capacity()*sizeof(T);
+    }
+
+    // Kernel temporaries of a render thread. Buckets clear them instead of 
+    // freeing, so they settle at the largest bucket seen and later buckets
+    // filter without touching the heap. What is handed over to writers 
+    // (deep, sidecar, census, partial files, tile cache) is theirs.
+    struct FilterScratch
+    {
+        FilterScratch() 
+            : accessor(positions, indices)
+            , pixelgrid(accessor)
+            , queue(pixelgrid.createQueue())
+            , highwater(0) {}
+        ~FilterScratch() { pixelgrid.destroyQueue(queue); }
+        FilterScratch(const FilterScratch &) = delete;
+        FilterScratch & operator=(const FilterScratch &) = delete;
+
+        // bytes held, grows only if a bucket had to allocate.
+        size_t footprint() const
+        {
+            return positions.capacity()*sizeof(UT_Vector3) + indices.capacity()*sizeof(int) \
+                + capacityBytes(subpixels) + capacityBytes(resolved) \
+                + capacityBytes(prefixx) + capacityBytes(ids) + capacityBytes(runstart) \
+                + capacityBytes(runid) + capacityBytes(rowrun) + capacityBytes(runfirst) \
+                + capacityBytes(runslot) + capacityBytes(runshare) + capacityBytes(cursor) \
+                + palette.capacityBytes() + slots.capacityBytes() + capacityBytes(accumulator) \
+                + capacityBytes(deep_pixel) + capacityBytes(matte_bucket.pixels) \
+                + capacityBytes(band);
+        }
+
+        // shader samples' grid (vex)
+        UT_Vector3Array  positions;
+        UT_ValArray<int> indices;
+        UT_Vector3Point  accessor;
+        UT_PointGrid<UT_Vector3Point> pixelgrid;
+        UT_Vector3PointQueue * queue;
+        std::vector<ResolvedSubpixel> subpixels;
+        std::vector<ResolvedId>       resolved;
+
+        // id runs (native)
+        std::vector<float>       prefixx;
+        std::vector<uint32_t>    ids;
+        std::vector<int>         runstart;
+        std::vector<uint32_t>    runid;
+        std::vector<int>         rowrun;
+        std::vector<int>         runfirst;
+        std::vector<PaletteSlot> runslot;
+        std::vector<float>       runshare;
+        std::vector<int>         cursor;
+
+        // pixels
+        IdPalette       palette;
+        SlotAccumulator slots;
+        IdCoverageArray accumulator;
+        DeepPixel       deep_pixel;
+        MatteBucket     matte_bucket;
+        CensusBucket    census_bucket;
+
+        // partial files' subpixels
+        BandEntries     band;
+
+        size_t highwater;
+    };
+
+    FilterScratch & threadScratch()
+    {
+        thread_local FilterScratch scratch;
+        return scratch;
+    }
+
+    // end of bucket: session's statistics learn if scratch's capacity grew,
+    // buffers handed over to writers aren't counted.
+    void countScratch(FilterScratch & scratch, AutomatteSession & session)
+    {
+        const size_t bytes = scratch.footprint();
+        session.countScratch(bytes, bytes > scratch.highwater);
+        scratch.highwater = SYSmax(scratch.highwater, bytes);
+    }
+
+    typedef VRAY_AutomatteFilter::FilterKernel FilterKernel;
+
+    template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+    FilterKernel pickSource(const Automatte_SampleSource source)
+    {
+        return (source == NATIVE) ? &VRAY_AutomatteFilter::filterNative<H, I, O> \
+            : &VRAY_AutomatteFilter::filterVex<H, I, O>;
+    }
+
+    template<Automatte_HashType H, Automatte_IdType I>
+    FilterKernel pickOutput(const Automatte_SampleSource source, const Automatte_OutputMode output)
+    {
+        switch (output) {
+            case PREVIEW:    return pickSource<H, I, PREVIEW>(source);
+            case DIAGNOSTIC: return pickSource<H, I, DIAGNOSTIC>(source);
+            case PACKED:     return pickSource<H, I, PACKED>(source);
+            default:         return pickSource<H, I, RANK>(source);
+        }
+    }
+
+    template<Automatte_HashType H>
+    FilterKernel pickIdType(const Automatte_SampleSource source, const Automatte_OutputMode output,
+        const Automatte_IdType idtype)
+    {
+        // material ids come from their own channel, but resolve like objects' ones.
+        switch (idtype) {
+            case ASSET: return pickOutput<H, ASSET>(source, output);
+            case GROUP: return pickOutput<H, GROUP>(source, output);
+            default:    return pickOutput<H, OBJECT>(source, output);
+        }
+    }
+
     float VRAYcomputeSumX2(int samplesperpixel, float width, int &halfsamplewidth)
     {
       float sumx2 = 0;
+      halfsamplewidth = footprintHalfWidth(samplesperpixel, width);
       if (samplesperpixel & 1 ) {
-          halfsamplewidth = (int)SYSfloor(float(samplesperpixel)*0.5f*width);
           for (int i = -halfsamplewidth; i <= halfsamplewidth; ++i) {
               float x = float(i)/float(samplesperpixel);
               sumx2 += x*x;
           }
       } else {
-          halfsamplewidth = (int)SYSfloor(float(samplesperpixel)*0.5f*width + 0.5f);
           for (int i = -halfsamplewidth; i < halfsamplewidth; ++i) {
               float x = (float(i)+0.5f)/float(samplesperpixel);
               sumx2 += x*x;
@@ -249,6 +594,112 @@ VRAY_AutomatteFilter::prepFilter(int samplesperpixelx, int samplesperpixely)
     myOpacitySumX2 = VRAYcomputeSumX2(mySamplesPerPixelX, myFilterWidth, myOpacitySamplesHalfX);
     myOpacitySumY2 = VRAYcomputeSumX2(mySamplesPerPixelY, myFilterWidth, myOpacitySamplesHalfY);
     myGaussianExp  = SYSexp(-myGaussianAlpha * myFilterWidth * myFilterWidth);
+
+    buildFootprint(mySamplesPerPixelX, myOpacitySamplesHalfX, myGaussianExp, myGaussianAlpha, 
+        myFootOffsetX, myWeightsX);
+    buildFootprint(mySamplesPerPixelY, myOpacitySamplesHalfY, myGaussianExp, myGaussianAlpha, 
+        myFootOffsetY, myWeightsY);
+
+    if (myPartialWriter) {
+        myPartialWriter->setFootprint(mySamplesPerPixelX, mySamplesPerPixelY, 
+            myFilterWidth, myGaussianAlpha);
+    }
+}
+
+void
+VRAY_AutomatteFilter::pickKernel()
+{
+    const Automatte_OutputMode output = (myDiagnostic) ? DIAGNOSTIC : \
+        (myRank == 0) ? PREVIEW : (myPacked) ? PACKED : RANK;
+    switch (myHashType) {
+        case MANTRA: myKernel = pickIdType<MANTRA>(mySampleSource, output, myIdType); break;
+        case DEEP:   myKernel = pickIdType<DEEP>  (mySampleSource, output, myIdType); break;
+        default:     myKernel = pickIdType<CRYPTO>(mySampleSource, output, myIdType); break;
+    }
+}
+
+template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+void VRAY_AutomatteFilter::writePixel(
+    float * destination,
+    const int vectorsize,
+    const float * color,
+    IdCoverageArray & ids,
+    const float norm) const
+{
+    if (O == PREVIEW) {
+        for (int i = 0; i < vectorsize; ++i) 
+            destination[i] = color[i] / norm;
+        return;
+    }
+
+    if (O == PACKED)
+        writePackedRank(destination, myRank, ids, norm);
+    else
+        writeRank(destination, myRank, ids, norm, id_to_float<H, I>);
+}
+
+void VRAY_AutomatteFilter::writeDiagnostic(
+    float * destination,
+    const int samples,
+    const int ids,
+    const int lookups) const
+{
+    destination[0] = static_cast<float>(samples);
+    destination[1] = static_cast<float>(ids);
+    destination[2] = static_cast<float>(lookups);
+    destination[3] = 0.f; // bucket's time, once it's done.
+}
+
+void VRAY_AutomatteFilter::writeDiagnosticTime(
+    float * destination,
+    const int vectorsize,
+    const int pixels,
+    const std::chrono::steady_clock::time_point & start) const
+{
+    const float elapsed = std::chrono::duration<float, std::nano>(
+        std::chrono::steady_clock::now() - start).count();
+    for (int i = 0; i < pixels; ++i)
+        destination[vectorsize*i + 3] = elapsed;
+}
+
+bool VRAY_AutomatteFilter::getBucketOrigin(
+    const int & destwidth, 
+    const int & destheight,
+    const int & sourcewidth,
+    const int & destxoffsetinsource,
+    const int & destyoffsetinsource,
+    const int & vectorsize,
+    const float * colordata,
+    const int * resolution,
+    int & originx,
+    int & originy) const
+{
+    // Filter doesn't know where the bucket is, so we take it from NDC of a
+    // subpixel covered by the shader (R&A channels), anywhere in the window
+    // bucket's footprints read. Sample lies inside of its subpixel, so the 
+    // origin is rounded from its subpixel position. False if none is covered:
+    // then no pixel of the bucket has any id either.
+    originx = 0;
+    originy = 0;
+    const int col0 = destxoffsetinsource + myFootOffsetX;
+    const int row0 = destyoffsetinsource + myFootOffsetY;
+    const int cols = (destwidth -1)*mySamplesPerPixelX + myWeightsX.size();
+    const int rows = (destheight-1)*mySamplesPerPixelY + myWeightsY.size();
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            const int sourceidx = (col0 + c) + sourcewidth*(row0 + r);
+            const float sx = colordata[vectorsize*sourceidx+0];
+            const float sy = colordata[vectorsize*sourceidx+3];
+            if (sx == 0.f && sy == 0.f)
+                continue;
+            const float subx = sx*resolution[0]*mySamplesPerPixelX - (c + myFootOffsetX) - 0.5f;
+            const float suby = sy*resolution[1]*mySamplesPerPixelY - (r + myFootOffsetY) - 0.5f;
+            originx = static_cast<int>(SYSfloor(subx / mySamplesPerPixelX + 0.5f));
+            originy = static_cast<int>(SYSfloor(suby / mySamplesPerPixelY + 0.5f));
+            return true;
+        }
+    }
+    return false;
 }
 
 void VRAY_AutomatteFilter::updateSourceBoundingBox(
@@ -307,6 +758,116 @@ void VRAY_AutomatteFilter::updateSourceBoundingBox(
     sourceBbox->expandBounds(-0.00f, -0.00f, 0.001f);
 }
 
+
+template<typename Entries>
+void VRAY_AutomatteFilter::writePartial(
+    const int originx,
+    const int originy,
+    const int destwidth,
+    const int destheight,
+    const int destxoffsetinsource,
+    const int destyoffsetinsource,
+    Entries entries) const
+{
+    // Pixels whose footprints leave node's crop (shaders' image:crop) are seams:
+    // AutomattesMerge refilters those from bands of all nodes around.
+    const ImageSize  resolution = mySession->getImageSize();
+    const CropWindow window     = mySession->getCrop();
+    int crop[4];
+    for (int axis = 0; axis < 2; ++axis) {
+        crop[axis]   = SYSclamp(static_cast<int>(SYSfloor(window[2*axis]  *resolution[axis] + 0.5f)), 
+            0, resolution[axis]);
+        crop[axis+2] = SYSclamp(static_cast<int>(SYSfloor(window[2*axis+1]*resolution[axis] + 0.5f)), 
+            0, resolution[axis]);
+    }
+    myPartialWriter->setImageSize(resolution[0], resolution[1]);
+    myPartialWriter->setCrop(crop);
+
+    DeepBucket partial;
+    partial.x = originx;
+    partial.y = originy;
+    partial.width  = destwidth;
+    partial.height = destheight;
+    partial.counts.resize(destwidth*destheight, 0);
+
+    const int footx = myWeightsX.size();
+    const int footy = myWeightsY.size();
+    const int col0  = destxoffsetinsource + myFootOffsetX;
+    const int row0  = destyoffsetinsource + myFootOffsetY;
+    const int cols  = (destwidth -1)*mySamplesPerPixelX + footx;
+    const int rows  = (destheight-1)*mySamplesPerPixelY + footy;
+
+    // kernel is done with thread's scratch, band and accumulator are reused.
+    FilterScratch & scratch = threadScratch();
+    BandEntries & subpixel = scratch.band;
+    IdCoverageArray & accumulator = scratch.accumulator;
+    for (int desty = 0; desty < destheight; ++desty) {
+        for (int destx = 0; destx < destwidth; ++destx) {
+            if (footprintLeavesCrop(originx + destx, mySamplesPerPixelX, myFootOffsetX, footx, 
+                    crop[0], crop[2], resolution[0]) \
+                || footprintLeavesCrop(originy + desty, mySamplesPerPixelY, myFootOffsetY, footy, 
+                    crop[1], crop[3], resolution[1]))
+                continue;
+
+            const int pixel = desty*destwidth + destx;
+            const int c0 = destx*mySamplesPerPixelX;
+            const int r0 = desty*mySamplesPerPixelY;
+            accumulator.clear();
+            float norm = 0.f;
+            for (int fy = 0; fy < footy; ++fy) {
+                for (int fx = 0; fx < footx; ++fx) {
+                    const float weight = myWeightsX[fx] * myWeightsY[fy];
+                    entries(col0 + c0 + fx, row0 + r0 + fy, subpixel);
+                    for (size_t i = 0; i < subpixel.size(); ++i) {
+                        if (subpixel[i].coverage > 0.f)
+                            accumulateId(accumulator, subpixel[i].id, 
+                                weight*subpixel[i].coverage, 0.f);
+                        norm += weight*subpixel[i].norm;
+                    }
+                }
+            }
+            partial.counts[pixel] = accumulator.size();
+            for (size_t i = 0; i < accumulator.size(); ++i) {
+                partial.ids.push_back(accumulator[i].id);
+                partial.coverage.push_back(accumulator[i].coverage / SYSmax(norm, 1e-6f));
+                partial.depth.push_back(FLT_MAX);
+            }
+        }
+    }
+
+    // Band: node's subpixels read by seams of any node. Source holds nothing
+    // outside the crop, except for filter's margin past image's edges.
+    auto rendered = [](const int sub, const int spp, const int first, const int end, 
+        const int res) { return (first == 0 || sub >= first*spp) && (end == res || sub < end*spp); };
+    const int subx0 = originx*mySamplesPerPixelX + myFootOffsetX;
+    const int suby0 = originy*mySamplesPerPixelY + myFootOffsetY;
+    for (int r = 0; r < rows; ++r) {
+        const int suby = suby0 + r;
+        if (!rendered(suby, mySamplesPerPixelY, crop[1], crop[3], resolution[1]))
+            continue;
+        const bool rowband = subpixelReadBySeam(suby, mySamplesPerPixelY, myFootOffsetY, 
+            footy, crop[1], crop[3], resolution[1]);
+        for (int c = 0; c < cols; ++c) {
+            const int subx = subx0 + c;
+            if (!rendered(subx, mySamplesPerPixelX, crop[0], crop[2], resolution[0]))
+                continue;
+            if (!rowband && !subpixelReadBySeam(subx, mySamplesPerPixelX, myFootOffsetX, 
+                footx, crop[0], crop[2], resolution[0]))
+                continue;
+            entries(col0 + c, row0 + r, subpixel);
+            for (size_t i = 0; i < subpixel.size(); ++i) {
+                partial.bandx.push_back(subx);
+                partial.bandy.push_back(suby);
+                partial.bandids.push_back(subpixel[i].id);
+                partial.bandcoverage.push_back(subpixel[i].coverage);
+                partial.bandnorm.push_back(subpixel[i].norm);
+            }
+        }
+    }
+
+    myPartialWriter->push(std::move(partial));
+}
+
 void
 VRAY_AutomatteFilter::filter(
     float *destination,
@@ -323,35 +884,98 @@ VRAY_AutomatteFilter::filter(
 {
 
     UT_ASSERT(vectorsize == 4);
+    if (!mySession || !myKernel) {
+        std::memset(destination, 0, destwidth*destheight*vectorsize*sizeof(float));
+        return;
+    }
+
+    TraceScope trace("filter");
+    (this->*myKernel)(destination, vectorsize, source, channel, sourcewidth, sourceheight,
+        destwidth, destheight, destxoffsetinsource, destyoffsetinsource, imager);
+}
 
+template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+void
+VRAY_AutomatteFilter::filterVex(
+    float *destination,
+    int vectorsize,
+    const VRAY_SampleBuffer &source,
+    int channel,
+    int sourcewidth,
+    int sourceheight,
+    int destwidth,
+    int destheight,
+    int destxoffsetinsource,
+    int destyoffsetinsource,
+    const VRAY_Imager &imager) const
+{
+    const std::chrono::steady_clock::time_point bucketstart = (O == DIAGNOSTIC) ? \
+        std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
     const float *const colordata = getSampleData(source, channel);
-    const float *const Object_ids  = (myHashType == MANTRA) ? \
-        getSampleData(source, getSpecialChannelIdx(imager, VRAY_SPECIAL_OPID)) : NULL;
-    const float *const Material_ids = (myHashType == MANTRA) ? \
-        getSampleData(source, getSpecialChannelIdx(imager, VRAY_SPECIAL_MATERIALID)) : NULL;
 
-     // Resolution convention R: Asset*, G: Object, B: Material, A: group*.
-     // * - not supported yet.
-    const int hash_index = (myIdType == OBJECT) ? 1 : 2;
+     // Asset and group ids are looked up by object id.
+    const IdTablesPtr idtables = (I == ASSET || I == GROUP) ? \
+        mySession->getIdTables() : IdTablesPtr();
+    FilterScratch & scratch = threadScratch();
+
+    // Where the bucket is: tiles, side outputs and rank skips are keyed on it.
+    const ImageSize resolution = mySession->getImageSize();
+    int originx = 0, originy = 0;
+    const bool located = resolution[0] > 0 && getBucketOrigin(destwidth, destheight, 
+        sourcewidth, destxoffsetinsource, destyoffsetinsource, vectorsize, colordata, 
+        resolution.data(), originx, originy);
+
+    // Deep ids are kept per pixel and handed over to writer thread at the end.
+    // Only session's first deep plane writes, buckets it can't place are empty.
+    DeepBucket deep_bucket;
+    const bool deep = (H == DEEP) && myDeepWriter && located;
+    if (deep) {
+        myDeepWriter->setImageSize(resolution[0], resolution[1]);
+        deep_bucket.x = originx;
+        deep_bucket.y = originy;
+        deep_bucket.width  = destwidth;
+        deep_bucket.height = destheight;
+        deep_bucket.counts.resize(destwidth*destheight, 0);
+    }
 
-    #ifdef VEXSAMPLES
+    // Rank planes have every id's coverage at hand, sidecar and census keep them all.
+    MatteBucket  & matte_bucket  = scratch.matte_bucket;
+    CensusBucket & census_bucket = scratch.census_bucket;
+    matte_bucket.pixels.clear();
+    census_bucket.ids.clear();
+    // Sidecar and census place pixels by bucket's origin, buckets it can't 
+    // place have no ids.
+    const bool matte  = (O == RANK || O == PACKED) && myMatteSidecar && located;
+    const bool census = (O == RANK || O == PACKED) && myCensus && located;
+    if (matte) {
+        matte_bucket.x = originx;
+        matte_bucket.y = originy;
+        matte_bucket.width  = destwidth;
+        matte_bucket.height = destheight;
+        myMatteSidecar->setImageSize(resolution[0], resolution[1]);
+    }
+    if (census) {
+        census_bucket.x = originx;
+        census_bucket.y = originy;
+        myCensus->setImageSize(resolution[0], resolution[1]);
+    }
 
-    // std::unique_ptr<UT_PointGrid<UT_Vector3Point>> pixelgrid(nullptr);
-    UT_Vector3Array  positions;
-    UT_ValArray<int> indices;
-    VEX_Samples  * samples = VEX_Samples_get();
+    float *const destination_start = destination;
+    UT_Vector3Array  & positions = scratch.positions;
+    UT_ValArray<int> & indices   = scratch.indices;
+    positions.clear();
+    indices.clear();
+    VEX_Samples  * samples = mySession->getSamples();
     SampleBucket * bucket  = nullptr;
 
-    int offset = 0;
-    int bucket_threadid = 0;
-    int fullbuckets = 0;
-    int foundDeepSamples = 0;
-    int bucketgridsize = 0;
-    int bucketsFoundInStore = 0;
+    bool publish = false;
 
 
     const int thread_id = SYSgetSTID();
-    const int myBucketCounter = VEX_Samples_increamentBucketCounter(thread_id);
+    // shaders' inserts into this store end here.
+    VEX_Trace_flushInserts();
+    // shaders open stores only on threads they run, filter may run elsewhere.
+    mySession->createStore(thread_id);
 
     #ifdef CONCURRENT_HASH_MAP
     UT_ASSERT(samples->find(thread_id));
@@ -369,7 +993,7 @@ VRAY_AutomatteFilter::filter(
         #endif
         BucketQueue::const_iterator jt = queue.begin();
         bucket = &(*jt);
-        for (; jt != queue.end(); ++jt, ++offset) {
+        for (; jt != queue.end(); ++jt) {
             if (jt->size() != 0) {
                 // bucket = &(*jt);
                 break; 
@@ -377,17 +1001,60 @@ VRAY_AutomatteFilter::filter(
         }
     }
 
+    // Rank planes past every id of the bucket would write zeros only: once a
+    // lower plane filtered the bucket, they skip the store altogether.
+    const bool countids = (O == RANK || O == PACKED) && myPlaneKind >= 0;
+    const int firstpair = SYSmax(myRank - 1, 0) * ((O == PACKED) ? PackedPairsPerPlane : 2);
+    const bool keyed = countids && !myProgressive && located;
+    const TileKey bucketkey = VEX_Tiles_key(originx, originy);
+    if (keyed && !deep && !matte && !census && !myPartialWriter \
+        && (bucket->size() == 0 || bucket->isRegistered() != 0) \
+        && mySession->emptyRank(myPlaneKind, bucketkey, firstpair)) {
+        std::memset(destination, 0, destwidth*destheight*vectorsize*sizeof(float));
+        bucket->clear();
+        mySession->insertBucket(thread_id);
+        return;
+    }
+
     UT_BoundingBox sourcebbox;
     updateSourceBoundingBox(destwidth, destheight, sourcewidth, sourceheight, 
         destxoffsetinsource, destyoffsetinsource, vectorsize, colordata, &sourcebbox);
 
-    if (bucket->size() != 0 && bucket->isRegistered() == 0) {
-        bucket->updateBoundingBox(0.f, 0.f, 0.01f);
-        bucketgridsize = bucket->registerBucket();
+    // Progressive: fresh samples of this pass go into tile's store and every
+    // plane filters all passes so far. Tiles without new samples reuse output.
+    // Buckets that couldn't be located have nothing shaded in reach, they 
+    // filter this pass alone and bypass the cache.
+    const bool progressive = myProgressive && myTileCache && located;
+    const TileKey tilekey = VEX_Tiles_key(originx, originy);
+    uint32_t generation = 0;
+    if (progressive) {
+        if (bucket->size() != 0 && bucket->isRegistered() == 0)
+            mySession->mergeTile(tilekey, *bucket);
+        bucket->clear();
+        generation = mySession->fillTile(tilekey, bucket);
+
+        TileCache::const_accessor ra;
+        const size_t pixels = destwidth*destheight*vectorsize;
+        if (myTileCache->find(ra, tilekey) && ra->second.generation == generation \
+            && ra->second.pixels.size() == pixels) {
+            std::memcpy(destination, ra->second.pixels.data(), pixels*sizeof(float));
+            bucket->clear();
+            mySession->insertBucket(thread_id);
+            return;
+        }
+    } else if (myProgressive) {
+        // neighbours aren't registered across passes, bucket's own samples only.
+    } else if (bucket->size() != 0 && bucket->isRegistered() == 0) {
+        // bounds, packing and indexing happen on session's worker, once 
+        // this filter is done with the samples (see below).
+        publish = true;
     } else {
+        // only wait if neighbours published so far aren't indexed yet.
+        mySession->waitIndexed();
         const UT_Vector3 source_min = sourcebbox.minvec();
         const UT_Vector3 source_max = sourcebbox.maxvec();
-        bucketsFoundInStore = bucket->fillBucket(source_min, source_max, bucket);
+        bucket->fillBucket(source_min, source_max, bucket, 
+            mySession->getBucketVector(), mySession->getRegisteredCount());
     }
     
 
@@ -397,227 +1064,549 @@ VRAY_AutomatteFilter::filter(
 
     for (int i=0; i<bucket_size; ++i) {
         const Sample & vexsample = bucket->at(i);
-        const UT_Vector3 pos = {vexsample[0], vexsample[1], 0.f}; // we ommit Pz, to flatten grid.
+        const UT_Vector3 pos = {vexsample.x, vexsample.y, 0.f}; // we ommit Pz, to flatten grid.
         positions.append(pos);
         indices.append(i);
     }
 
-    // Point Grid structures/objects (we could use persistand grid per bucket once we move to bucket class)
-    UT_Vector3Point accessor(positions, indices);
-    UT_PointGrid<UT_Vector3Point> pixelgrid(accessor);
-    // pixelgrid = std::unique_ptr<UT_PointGrid<UT_Vector3Point>> (new UT_PointGrid<UT_Vector3Point> (accessor));
-
-    // 
+    // Point grid and its queue are thread's, rebuilt over this bucket's positions.
+    UT_PointGrid<UT_Vector3Point> & pixelgrid = scratch.pixelgrid;
+    UT_Vector3PointQueue * const queue = scratch.queue;
     if (pixelgrid.canBuild(sourcewidth, sourceheight, 1)) {
+        TraceScope trace("grid build");
         // pixelgrid.build(bucket->getBBox()->minvec(), bucket->getBBox()->size(),sourcewidth, sourceheight, 1);
          pixelgrid.build(sourcebbox.minvec(), sourcebbox.size(),sourcewidth, sourceheight, 1);
+    } else {
+        pixelgrid.clear();
     }
-
-    UT_Vector3PointQueue *queue;
-    queue = pixelgrid.createQueue();
     UT_PointGridIterator<UT_Vector3Point> iter;
 
-    #endif
-    
+    const int footx = myWeightsX.size();
+    const int footy = myWeightsY.size();
+
+    // Stage 1: every subpixel read by the bucket's footprints is looked up once,
+    // and its samples are merged per id. Footprints overlap, so without this
+    // a subpixel was looked up by every pixel reading it (4x at width 2).
+    const int col0 = destxoffsetinsource + myFootOffsetX;
+    const int row0 = destyoffsetinsource + myFootOffsetY;
+    const int cols = (destwidth -1)*mySamplesPerPixelX + footx;
+    const int rows = (destheight-1)*mySamplesPerPixelY + footy;
+    std::vector<ResolvedSubpixel> & subpixels = scratch.subpixels;
+    std::vector<ResolvedId> & resolved = scratch.resolved;
+    subpixels.assign(SYSmax(cols*rows, 0), ResolvedSubpixel());
+    resolved.clear();
+    resolved.reserve(subpixels.size());
+    IdPalette & palette = scratch.palette;
+    palette.clear();
 
     int horrorus = 0;
-    // Run over destination pixels
+    const uint64_t loopstart = VEX_Trace_enabled() ? VEX_Trace_now() : 0;
+    for (int r = 0; r < rows; ++r)
+    {
+        for (int c = 0; c < cols; ++c)
+        {
+            const int sourceidx = (col0 + c) + sourcewidth*(row0 + r);
+            const float sx = colordata[vectorsize*sourceidx+0]; // G&B are reserved for id and coverage by bellow setup
+            const float sy = colordata[vectorsize*sourceidx+3]; // se we end up with using R&A for NDC coords.
+                  UT_Vector3 position = {sx, sy, 0.f};
+            float radius = FLT_MIN * 10;//0.001f;//?
+            iter = pixelgrid.findCloseKeys(position, *queue, radius);
+
+            // horrorus hackerous...
+            int lookups = 0;
+            while(iter.entries() == 0) {
+                lookups++;
+                radius *= 1.1;
+                iter = pixelgrid.findCloseKeys(position, *queue, radius);
+            }
+            horrorus += lookups;
+
+            ResolvedSubpixel & subpixel = subpixels[r*cols + c];
+            subpixel.first   = resolved.size();
+            subpixel.samples = SYSmax(static_cast<int>(iter.entries()), 1);
+            subpixel.lookups = lookups;
+
+            for (;!iter.atEnd(); iter.advance()) {
+                const size_t idx = iter.getValue();
+                UT_ASSERT(idx < bucket_size);
+                const Sample & vexsample = bucket->at(idx);
+                resolveIds<I>(vexsample.id, idtables.get(), 
+                    [&](const uint32_t _id, const float share) {
+                    if (O == PREVIEW)
+                        accumulateFalseColor(subpixel.color, _id, share);
+                    if (O != PREVIEW || deep)
+                        mergeResolvedId(resolved, subpixel.first, palette.encode(_id), 
+                            vexsample.Af, vexsample.z);
+                });
+            }
+            subpixel.count = resolved.size() - subpixel.first;
+        }
+    }
+
+    // Stage 2: pixels gather their footprint's resolved subpixels.
+    SlotAccumulator & slots = scratch.slots;
+    slots.resize(palette.size());
+    IdCoverageArray & accumulator = scratch.accumulator;
+    accumulator.reserve(64);
+    DeepPixel & deep_pixel = scratch.deep_pixel;
+    IdCountHistogram pixelids;
+
     for (int desty = 0; desty < destheight; ++desty) 
     {
         for (int destx = 0; destx < destwidth; ++destx)
         {
-            // First, compute the sample bounds of the pixel
-            const int sourcefirstx = destxoffsetinsource + destx*mySamplesPerPixelX;
-            const int sourcefirsty = destyoffsetinsource + desty*mySamplesPerPixelY;
-            const int sourcelastx = sourcefirstx + mySamplesPerPixelX-1;
-            const int sourcelasty = sourcefirsty + mySamplesPerPixelY-1;
-            // Find the first sample to read for opacity and Pz
-            const int sourcefirstox = sourcefirstx + (mySamplesPerPixelX>>1) - myOpacitySamplesHalfX;
-            const int sourcefirstoy = sourcefirsty + (mySamplesPerPixelY>>1) - myOpacitySamplesHalfY;
-            // // Find the last sample to read for colour and z gradients
-            const int sourcelastox = sourcefirstx + ((mySamplesPerPixelX-1)>>1) + myOpacitySamplesHalfX;
-            const int sourcelastoy = sourcefirsty + ((mySamplesPerPixelY-1)>>1) + myOpacitySamplesHalfY;
+            const int firstcol = destx*mySamplesPerPixelX;
+            const int firstrow = desty*mySamplesPerPixelY;
 
-            int sourcefirstrx = sourcefirstox;
-            int sourcefirstry = sourcefirstoy;
-            int sourcelastrx = sourcelastox;
-            int sourcelastry = sourcelastoy;
-          
-            UT_StackBuffer<float> sample(vectorsize);
-            for (int i = 0; i < vectorsize; ++i)
-                sample[i] = 0.f;
-
-            HashMap hash_map;
+            float sample[4] = {0.f, 0.f, 0.f, 0.f};
             float gaussianNorm = 0;
+            if (deep)
+                deep_pixel.clear();
+            float deepNorm = 0;
+            int pixelSamples = 0;
+            int pixelLookups = 0;
 
-            for (int sourcey = sourcefirstry; sourcey <= sourcelastry; ++sourcey)
+            for (int fy = 0; fy < footy; ++fy)
             {
-                for (int sourcex = sourcefirstrx; sourcex <= sourcelastrx; ++sourcex)
+                const float weighty = myWeightsY[fy];
+                const ResolvedSubpixel * row = &subpixels[(firstrow + fy)*cols + firstcol];
+                for (int fx = 0; fx < footx; ++fx)
                 {
-                    const int sourceidx = sourcex + sourcewidth*sourcey;
-                    if(sourcex >= sourcefirstox && sourcex <= sourcelastox &&\
-                      sourcey >= sourcefirstoy && sourcey <= sourcelastoy) 
-                    {
-
-                        // Find (x,y) of sample relative to *middle* of pixel
-                        const float x = (float(sourcex)-0.5f*float(sourcelastx + sourcefirstx))\
-                            / float(mySamplesPerPixelX);
-                        const float y = (float(sourcey)-0.5f*float(sourcelasty + sourcefirsty))\
-                            / float(mySamplesPerPixelY);
-
-                        // TODO: remove magic number
-                        const float gaussianWeight = gaussianFilter(x*1.66667, y*1.66667, myGaussianExp, myGaussianAlpha);
-                    
-                        #ifdef VEXSAMPLES
-
-                        const float sx = colordata[vectorsize*sourceidx+0]; // G&B are reserved for id and coverage by bellow setup
-                        const float sy = colordata[vectorsize*sourceidx+3]; // se we end up with using R&A for NDC coords.
-                              UT_Vector3 position = {sx, sy, 0.f};
-                        float radius = FLT_MIN * 10;//0.001f;//?
-
-                        // int idx, idy, idz;
-                        // const bool found_voxel = pixelgrid.posToIndex(position, idx, idy, idz, true);
-                        // idx = (int)sx; idy = (int)sy; idz = 1;
-                        // iter = pixelgrid.getKeysAt(idx, idy, idz, *queue);
-                        iter = pixelgrid.findCloseKeys(position, *queue, radius);
-
-                        // horrorus hackerous...
-                        while(iter.entries() == 0) {
-                            horrorus++;
-                            radius *= 1.1;
-                            iter = pixelgrid.findCloseKeys(position, *queue, radius);
-                        }
+                    const ResolvedSubpixel & subpixel = row[fx];
+                    // deep lists are box filtered, so only pixel's own samples count.
+                    const bool own_sample = (deep || O == DIAGNOSTIC) && \
+                        fx + myFootOffsetX >= 0 && fx + myFootOffsetX < mySamplesPerPixelX && \
+                        fy + myFootOffsetY >= 0 && fy + myFootOffsetY < mySamplesPerPixelY;
+                    const bool deep_sample = deep && own_sample;
+
+                    const float gaussianWeight = myWeightsX[fx] * weighty;
+                    gaussianNorm += (gaussianWeight*subpixel.samples);
+                    if (deep_sample)
+                        deepNorm += subpixel.samples;
+                    if (O == DIAGNOSTIC) {
+                        pixelLookups += subpixel.lookups;
+                        if (own_sample)
+                            pixelSamples += subpixel.samples;
+                    }
 
-                        const int entries = SYSmax((float)iter.entries(), 1.f);
-
-                        foundDeepSamples += (iter.entries() - 1);
-                        const float repEntries = 1.f/(float)entries; 
-                        gaussianNorm += (gaussianWeight*entries);
-
-                        // TMP pseudo color to check offset:
-                        if (iter.entries() == 0) {
-                            //sample[0] += /*float(offset)*/1.f * gaussianWeight;
-                        } else {
-                            for (;!iter.atEnd(); iter.advance()) {
-                                const size_t idx = iter.getValue();
-                                UT_ASSERT(idx < bucket_size);
-                                const Sample & vexsample = bucket->at(idx);
-                                const float _id =  vexsample[3];
-                                // FIXME: cov. should be a sum of all samples behind the current one. (Pz>current sample)
-                                const float coverage = vexsample[4] * gaussianWeight; 
-
-                                // borrowed: https://github.com/MercenariesEngineering/openexrid/blob/master/nuke/DeepOpenEXRId.cpp
-                                #ifdef HALTON_FALSE_COLORS
-                                    const float primes[3] = {2,3,5};
-                                    sample[0] += gaussianWeight * halton(primes[0], _id);
-                                    sample[1] += gaussianWeight * halton(primes[1], _id);
-                                    sample[2] += gaussianWeight * halton(primes[2], _id); 
-                                #else
-                                uint seed  = static_cast<uint>(_id);
-                                    sample[1] += gaussianWeight * SYSfastRandom(seed);
-                                         seed += 2345;
-                                    sample[2] += gaussianWeight * SYSfastRandom(seed); 
-                                #endif
-
-                                if (hash_map.find(_id) == hash_map.end()) {
-                                    hash_map.insert(std::pair<float, float>(_id, coverage));
-                                }
-                                else {
-                                    hash_map[_id] += coverage;
-                                }
-                            }
-                        }
+                    if (O == PREVIEW) {
+                        for (int i = 0; i < 3; ++i)
+                            sample[i] += gaussianWeight * subpixel.color[i];
+                    } else {
+                        // FIXME: cov. should be a sum of all samples behind the current one. (Pz>current sample)
+                        for (int i = subpixel.first; i < subpixel.first + subpixel.count; ++i)
+                            slots.add(resolved[i].slot, resolved[i].coverage * gaussianWeight, 0.f);
+                    }
 
-                        #else
-
-                        gaussianNorm += gaussianWeight;
-                        // no transparency support (because of precomposed shader samples).
-                        const float coverage = 1.f * gaussianWeight; //fixme
-                        // This is ugly, fixme
-                        const float object_id   = (myHashType == MANTRA) ? \
-                            Object_ids[sourceidx] : colordata[vectorsize*sourceidx+hash_index];    // G -> object_id
-                        const float material_id = (myHashType == MANTRA) ? \
-                            Material_ids[sourceidx] : colordata[vectorsize*sourceidx+hash_index];  // B -> material_id
-
-                        const float _id = (myIdType == OBJECT) ? object_id : material_id; 
-
-                        // 
-                         #ifdef HALTON_FALSE_COLORS
-                        // borrowed: https://github.com/MercenariesEngineering/openexrid/blob/\
-                        // master/nuke/DeepOpenEXRId.cpp
-                        const float primes[3] = {2,3,5};
-                            sample[0] += gaussianWeight * halton(primes[0], _id);
-                            sample[1] += gaussianWeight * halton(primes[1], _id);
-                            sample[2] += gaussianWeight * halton(primes[2], _id); 
-                        #else
-                            uint seed  = static_cast<uint>(_id);
-                            sample[1] += gaussianWeight * SYSfastRandom(seed);
-                                 seed += 2345;
-                            sample[2] += gaussianWeight * SYSfastRandom(seed); 
-                        #endif
-                        
-                        // 
-                        if (hash_map.find(_id) == hash_map.end()) {
-                            hash_map.insert(std::pair<float, float>(_id, coverage));
+                    if (deep_sample) {
+                        for (int i = subpixel.first; i < subpixel.first + subpixel.count; ++i) {
+                            DeepSample & deepsample = deepSample(deep_pixel, palette.decode(resolved[i].slot));
+                            deepsample.coverage += resolved[i].coverage;
+                            deepsample.depth = SYSmin(deepsample.depth, resolved[i].depth);
                         }
-                        else {
-                            hash_map[_id]   += coverage;
-                        } 
-
-                        #endif // end of VEXSAMPLES
                     }
                 }
             }
+            slots.flush(palette, accumulator);
+            if (countids)
+                pixelids.add(accumulator.size());
             
-            HashMap coverage_map;
-            // sort by coverage 
-            HashMap::const_iterator it(hash_map.begin());
-            for(; it != hash_map.end(); ++it) {
-                const float coverage  = it->second;// / gaussianNorm;
-                const float object_id = it->first;// ? coverage != 0.0f: 0.f;
-                coverage_map.insert(std::pair<float, float>(coverage, object_id));
+            if (deep && deepNorm > 0.f) {
+                appendDeepPixel(deep_bucket, desty*destwidth + destx, deep_pixel, deepNorm);
             }
 
-            HashMap::const_reverse_iterator rit(coverage_map.rbegin());
-            if (myRank == 0) {
-                // sample[2] = rit->second;
-                for (int i = 0; i< vectorsize; ++i, ++destination) {
-                    *destination  = sample[i] / gaussianNorm; 
-                }
-                    
-            } else {
-        
-                const size_t id_offset = (static_cast<size_t>(myRank) - 1) * 2; 
-                std::advance(rit, id_offset);
-
-                for (int i = id_offset; i < 2; ++rit,  ++i) {
-                    if (rit == coverage_map.rend()) {
-                        destination += i*2;
-                        break;
-                    }
-                    destination[0] = rit->second; // object_id
-                    destination[1] = rit->first / gaussianNorm; // coverage
-                    destination += 2;
-                }   
-                       
-            }
+            if (matte)
+                appendMattePixel(matte_bucket, desty*destwidth + destx, accumulator, gaussianNorm);
+            if (census)
+                appendCensusPixel(census_bucket, destx, desty, accumulator, gaussianNorm);
+
+            if (O == DIAGNOSTIC)
+                writeDiagnostic(destination, pixelSamples, accumulator.size(), pixelLookups);
+            else
+                writePixel<H, I, O>(destination, vectorsize, sample, accumulator, gaussianNorm);
+            destination += vectorsize;
          // end of canonical way 
         }
     }
 
 
+ 
+ 
     // end of destx/desty loop;
-    #ifdef VEXSAMPLES 
-    pixelgrid.destroyQueue(queue);
-    DEBUG_PRINT("Filter thread: %i, bucket count:%i (size: %lu) (offset: %i), (dim: %i, %i), (deep: %i), (bucketgrid: %i), (neighbours: %i)\n", \
-        thread_id, myBucketCounter, bucket_size, offset, destwidth, destheight, foundDeepSamples, bucketgridsize, bucketsFoundInStore);
-    bucket->clear();
-    VEX_Samples_insertBucket(thread_id);
+    if (VEX_Trace_enabled())
+        VEX_Trace_record("pixel loop", loopstart, VEX_Trace_now());
 
-    #endif
+    if (countids) {
+        mySession->countIds(myPlaneKind, firstpair, pixelids);
+        if (keyed)
+            mySession->setBucketIds(myPlaneKind, bucketkey, firstpair, pixelids.max());
+    }
 
+    if (myTileOutputs) {
+        if (located)
+            myTileOutputs->set(tilekey, generation, (deep) ? &deep_bucket : nullptr, 
+                (matte) ? &matte_bucket : nullptr, (census) ? &census_bucket : nullptr);
+    } else {
+        if (deep)
+            myDeepWriter->push(std::move(deep_bucket));
+        if (matte)
+            myMatteSidecar->push(matte_bucket);
+        if (census)
+            myCensus->push(census_bucket);
+    }
+
+    if (myPartialWriter && located && bucket_size) {
+        writePartial(originx, originy, destwidth, destheight, 
+            destxoffsetinsource, destyoffsetinsource, 
+            [&](const int sourcex, const int sourcey, BandEntries & entries) {
+            entries.clear();
+            const int sourceidx = sourcex + sourcewidth*sourcey;
+            UT_Vector3 position = {colordata[vectorsize*sourceidx+0], 
+                colordata[vectorsize*sourceidx+3], 0.f};
+            float radius = FLT_MIN * 10;
+            iter = pixelgrid.findCloseKeys(position, *queue, radius);
+            while(iter.entries() == 0) {
+                radius *= 1.1;
+                iter = pixelgrid.findCloseKeys(position, *queue, radius);
+            }
+            for (;!iter.atEnd(); iter.advance()) {
+                const Sample & vexsample = bucket->at(iter.getValue());
+                // one sample counts once in the norm, whatever many ids it resolves to.
+                float norm = 1.f;
+                resolveIds<I>(vexsample.id, idtables.get(), 
+                    [&](const uint32_t _id, const float share) {
+                    const BandEntry entry = {_id, vexsample.Af, norm};
+                    entries.push_back(entry);
+                    norm = 0.f;
+                });
+                if (norm > 0.f) {
+                    const BandEntry entry = {0, 0.f, norm};
+                    entries.push_back(entry);
+                }
+            }
+        });
+    }
+
+    if (O == DIAGNOSTIC) {
+        writeDiagnosticTime(destination_start, vectorsize, destwidth*destheight, bucketstart);
+    }
 
+    if (progressive) {
+        TileCache::accessor wa;
+        myTileCache->insert(wa, tilekey);
+        wa->second.generation = generation;
+        wa->second.pixels.assign(destination_start, destination);
+    }
+
+    // samples' storage moves into worker's queue, no copy.
+    if (publish)
+        mySession->publishBucket(*bucket);
+    countScratch(scratch, *mySession);
+    bucket->clear();
+    mySession->insertBucket(thread_id);
 }
 
 
+template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+void
+VRAY_AutomatteFilter::filterNative(
+    float *destination,
+    int vectorsize,
+    const VRAY_SampleBuffer &source,
+    int channel,
+    int sourcewidth,
+    int sourceheight,
+    int destwidth,
+    int destheight,
+    int destxoffsetinsource,
+    int destyoffsetinsource,
+    const VRAY_Imager &imager) const
+{
+    // Shader samples are precomposed here, so every subpixel carries a single
+    // id with full coverage. Ids are gathered once per source row, merged into 
+    // runs of equal ids, and runs are accumulated with separable weights, 
+    // so the inner loops neither branch on modes nor check bounds.
+    const std::chrono::steady_clock::time_point bucketstart = (O == DIAGNOSTIC) ? \
+        std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    const float *const colordata = getSampleData(source, channel);
+    float *const destination_start = destination;
+
+    // Pick id source once: special channels, or G (object) / B (material) of the raster.
+    const float * idsource = colordata + ((myIdType == MATERIAL) ? 2 : 1);
+    int idstride = vectorsize;
+    if (H == MANTRA) {
+        const VRAY_SpecialChannel idchannel = (myIdType == MATERIAL) ? \
+            VRAY_SPECIAL_MATERIALID : VRAY_SPECIAL_OPID;
+        idsource = getSampleData(source, getSpecialChannelIdx(imager, idchannel));
+        idstride = 1;
+    }
+    const IdTablesPtr idtables = (I == ASSET || I == GROUP) ? \
+        mySession->getIdTables() : IdTablesPtr();
+
+    // Filter footprint is the same for every pixel, relative to its first subpixel.
+    const int footoffx = myFootOffsetX;
+    const int footoffy = myFootOffsetY;
+    const int footx = myWeightsX.size();
+    const int footy = myWeightsY.size();
+
+    // Deep ids come from pixel's own subpixels, as far as the gathered 
+    // footprint reaches: filters narrower than a pixel (-w < 1) cut the box.
+    const int boxx0 = SYSmax(footoffx, 0), boxx1 = SYSmin(footoffx + footx, mySamplesPerPixelX);
+    const int boxy0 = SYSmax(footoffy, 0), boxy1 = SYSmin(footoffy + footy, mySamplesPerPixelY);
+    const float boxsamples = float(SYSmax((boxx1 - boxx0)*(boxy1 - boxy0), 1));
+
+    FilterScratch & scratch = threadScratch();
+
+    // gaussianFilter() is separable: keep x weights as prefix sums to weight whole runs.
+    std::vector<float> & prefixx = scratch.prefixx;
+    prefixx.assign(footx + 1, 0.f);
+    for (int i = 0; i < footx; ++i)
+        prefixx[i+1] = prefixx[i] + myWeightsX[i];
+    float sumy = 0.f;
+    for (int i = 0; i < footy; ++i)
+        sumy += myWeightsY[i];
+    const float gaussianNorm = prefixx[footx] * sumy;
+
+    // Source window read by the whole bucket.
+    const int col0 = destxoffsetinsource + footoffx;
+    const int row0 = destyoffsetinsource + footoffy;
+    const int cols = (destwidth -1)*mySamplesPerPixelX + footx;
+    const int rows = (destheight-1)*mySamplesPerPixelY + footy;
+
+    // Gather ids once per row, then split each row into runs of equal ids.
+    std::vector<uint32_t> & ids      = scratch.ids;
+    std::vector<int>      & runstart = scratch.runstart; // column of run start, rows are terminated by cols
+    std::vector<uint32_t> & runid    = scratch.runid;
+    std::vector<int>      & rowrun   = scratch.rowrun;
+    ids.resize(rows*cols);
+    rowrun.resize(rows);
+    runstart.clear();
+    runid.clear();
+    runstart.reserve(rows*8);
+    runid.reserve(rows*8);
+    for (int r = 0; r < rows; ++r) {
+        const float * __restrict src = idsource + idstride*(col0 + sourcewidth*(row0 + r));
+        uint32_t * __restrict row = &ids[r*cols];
+        if (idstride == 1) {
+            for (int c = 0; c < cols; ++c) 
+                row[c] = channel_to_id(src[c]);
+        } else {
+            for (int c = 0; c < cols; ++c) 
+                row[c] = channel_to_id(src[c*idstride]);
+        }
+
+        rowrun[r] = runstart.size();
+        runstart.push_back(0);
+        runid.push_back(row[0]);
+        for (int c = 1; c < cols; ++c) {
+            if (row[c] != row[c-1]) {
+                runstart.push_back(c);
+                runid.push_back(row[c]);
+            }
+        }
+        runstart.push_back(cols);
+        runid.push_back(0);
+    }
 
+    // Runs' ids are resolved once into palette slots, pixels only sum slots.
+    IdPalette & palette = scratch.palette;
+    std::vector<int>         & runfirst = scratch.runfirst;
+    std::vector<PaletteSlot> & runslot  = scratch.runslot;
+    std::vector<float>       & runshare = scratch.runshare;
+    palette.clear();
+    runfirst.resize(runid.size() + 1);
+    runslot.clear();
+    runshare.clear();
+    runslot.reserve(runid.size());
+    runshare.reserve(runid.size());
+    for (size_t run = 0; run < runid.size(); ++run) {
+        runfirst[run] = runslot.size();
+        if (runstart[run] == cols) // row's terminator
+            continue;
+        resolveIds<I>(runid[run], idtables.get(), 
+            [&](const uint32_t _id, const float share) {
+            runslot.push_back(palette.encode(_id));
+            runshare.push_back(share);
+        });
+    }
+    runfirst[runid.size()] = runslot.size();
+
+    // Deep lists are box filtered over pixel's own subpixels.
+    const float *const Pz_data = (H == DEEP) ? \
+        getSampleData(source, getSpecialChannelIdx(imager, VRAY_SPECIAL_PZ)) : NULL;
+    // Where the bucket is, progressive passes replace tile's side outputs.
+    const ImageSize resolution = mySession->getImageSize();
+    int originx = 0, originy = 0;
+    const bool located = resolution[0] > 0 && getBucketOrigin(destwidth, destheight, 
+        sourcewidth, destxoffsetinsource, destyoffsetinsource, vectorsize, colordata, 
+        resolution.data(), originx, originy);
+
+    // Only session's first deep plane writes, buckets it can't place are empty.
+    DeepBucket deep_bucket;
+    const bool deep = (H == DEEP) && myDeepWriter && located;
+    if (deep) {
+        myDeepWriter->setImageSize(resolution[0], resolution[1]);
+        deep_bucket.x = originx;
+        deep_bucket.y = originy;
+        deep_bucket.width  = destwidth;
+        deep_bucket.height = destheight;
+        deep_bucket.counts.resize(destwidth*destheight, 0);
+    }
+
+    // Rank planes have every id's coverage at hand, sidecar and census keep them all.
+    MatteBucket  & matte_bucket  = scratch.matte_bucket;
+    CensusBucket & census_bucket = scratch.census_bucket;
+    matte_bucket.pixels.clear();
+    census_bucket.ids.clear();
+    // Sidecar and census place pixels by bucket's origin, buckets it can't 
+    // place have no ids.
+    const bool matte  = (O == RANK || O == PACKED) && myMatteSidecar && located;
+    const bool census = (O == RANK || O == PACKED) && myCensus && located;
+    if (matte) {
+        matte_bucket.x = originx;
+        matte_bucket.y = originy;
+        matte_bucket.width  = destwidth;
+        matte_bucket.height = destheight;
+        myMatteSidecar->setImageSize(resolution[0], resolution[1]);
+    }
+    if (census) {
+        census_bucket.x = originx;
+        census_bucket.y = originy;
+        myCensus->setImageSize(resolution[0], resolution[1]);
+    }
+
+    SlotAccumulator & slots = scratch.slots;
+    slots.resize(palette.size());
+    IdCoverageArray & accumulator = scratch.accumulator;
+    accumulator.reserve(64);
+    DeepPixel & deep_pixel = scratch.deep_pixel;
+    std::vector<int> & cursor = scratch.cursor;
+    cursor.resize(footy);
+    // ids per pixel, for the rank count report (no skipping, nothing keys the bucket).
+    const bool countids = (O == RANK || O == PACKED) && myPlaneKind >= 0;
+    const int firstpair = SYSmax(myRank - 1, 0) * ((O == PACKED) ? PackedPairsPerPlane : 2);
+    IdCountHistogram pixelids;
+
+    const uint64_t loopstart = VEX_Trace_enabled() ? VEX_Trace_now() : 0;
+    for (int desty = 0; desty < destheight; ++desty)
+    {
+        const int firstrow = desty*mySamplesPerPixelY;
+        // runs are walked left to right as destx grows.
+        for (int r = 0; r < footy; ++r)
+            cursor[r] = rowrun[firstrow + r];
+
+        for (int destx = 0; destx < destwidth; ++destx)
+        {
+            const int firstcol = destx*mySamplesPerPixelX;
+            const int lastcol  = firstcol + footx;
+            int pixelRuns = 0;
+
+            for (int r = 0; r < footy; ++r)
+            {
+                const float wy = myWeightsY[r];
+                int run = cursor[r];
+                while (runstart[run+1] <= firstcol)
+                    ++run;
+                cursor[r] = run;
+
+                for (; runstart[run] < lastcol; ++run) {
+                    if (O == DIAGNOSTIC)
+                        ++pixelRuns;
+                    const int start = SYSmax(runstart[run],   firstcol) - firstcol;
+                    const int end   = SYSmin(runstart[run+1], lastcol)  - firstcol;
+                    const float weight = (prefixx[end] - prefixx[start]) * wy;
+                    for (int i = runfirst[run]; i < runfirst[run+1]; ++i)
+                        slots.add(runslot[i], weight, weight * runshare[i]);
+                }
+            }
+            slots.flush(palette, accumulator);
+            if (countids)
+                pixelids.add(accumulator.size());
+
+            if (deep) {
+                deep_pixel.clear();
+                const int boxx = firstcol - footoffx;
+                const int boxy = firstrow - footoffy;
+                for (int y = boxy0; y < boxy1; ++y) {
+                    for (int x = boxx0; x < boxx1; ++x) {
+                        const int sourceidx = (col0 + boxx + x) + sourcewidth*(row0 + boxy + y);
+                        const float depth = Pz_data[sourceidx];
+                        resolveIds<I>(ids[(boxy + y)*cols + boxx + x], idtables.get(), 
+                            [&](const uint32_t _id, const float share) {
+                            DeepSample & deepsample = deepSample(deep_pixel, _id);
+                            deepsample.coverage += 1.f;
+                            deepsample.depth = SYSmin(deepsample.depth, depth);
+                        });
+                    }
+                }
+                appendDeepPixel(deep_bucket, desty*destwidth + destx, deep_pixel, boxsamples);
+            }
+
+            float sample[4] = {0.f, 0.f, 0.f, 0.f};
+            if (O == PREVIEW) {
+                // false colors once per id instead of once per subpixel.
+                const size_t size = accumulator.size();
+                for (size_t i = 0; i < size; ++i)
+                    accumulateFalseColor(sample, accumulator[i].id, accumulator[i].color);
+            }
+
+            if (matte)
+                appendMattePixel(matte_bucket, desty*destwidth + destx, accumulator, gaussianNorm);
+            if (census)
+                appendCensusPixel(census_bucket, destx, desty, accumulator, gaussianNorm);
+
+            if (O == DIAGNOSTIC)
+                writeDiagnostic(destination, mySamplesPerPixelX*mySamplesPerPixelY, 
+                    accumulator.size(), pixelRuns);
+            else
+                writePixel<H, I, O>(destination, vectorsize, sample, accumulator, gaussianNorm);
+            destination += vectorsize;
+        }
+    }
+
+    if (VEX_Trace_enabled())
+        VEX_Trace_record("pixel loop", loopstart, VEX_Trace_now());
+
+    if (countids)
+        mySession->countIds(myPlaneKind, firstpair, pixelids);
+
+    if (myTileOutputs) {
+        if (located)
+            myTileOutputs->set(VEX_Tiles_key(originx, originy), 0, 
+                (deep) ? &deep_bucket : nullptr, (matte) ? &matte_bucket : nullptr, 
+                (census) ? &census_bucket : nullptr);
+    } else {
+        if (deep)
+            myDeepWriter->push(std::move(deep_bucket));
+        if (matte)
+            myMatteSidecar->push(matte_bucket);
+        if (census)
+            myCensus->push(census_bucket);
+    }
+
+    if (O == DIAGNOSTIC) {
+        writeDiagnosticTime(destination_start, vectorsize, destwidth*destheight, bucketstart);
+    }
+
+    if (myPartialWriter && located) {
+        writePartial(originx, originy, destwidth, destheight, 
+            destxoffsetinsource, destyoffsetinsource, 
+            [&](const int sourcex, const int sourcey, BandEntries & entries) {
+            entries.clear();
+            const uint32_t objid = channel_to_id(
+                idsource[idstride*(sourcex + sourcewidth*sourcey)]);
+            float norm = 1.f;
+            resolveIds<I>(objid, idtables.get(), 
+                [&](const uint32_t _id, const float share) {
+                const BandEntry entry = {_id, 1.f, norm};
+                entries.push_back(entry);
+                norm = 0.f;
+            });
+            if (norm > 0.f) {
+                const BandEntry entry = {0, 0.f, norm};
+                entries.push_back(entry);
+            }
+        });
+    }
+    countScratch(scratch, *mySession);
+}
@@ -13,9 +13,17 @@
 
 #include <VRAY/VRAY_PixelFilter.h>
 #include <VRAY/VRAY_Procedural.h>
+#include <tbb/concurrent_hash_map.h>
+#include <chrono>
+
+#include "AutomattesCensus.hpp"
+#include "AutomattesDeepWriter.hpp"
+#include "AutomattesFootprint.hpp"
+#include "AutomattesHelper.hpp"
+#include "AutomattesPacked.hpp"
+#include "AutomattesRank.hpp"
+#include "AutomattesSidecar.hpp"
 
-#define DEBUG
-#define VEXSAMPLES
 #define HALTON_FALSE_COLORS
 
 #ifdef DEBUG
@@ -25,7 +33,8 @@
 #endif
 
 
-typedef  std::map<float, float>  HashMap;
+// id -> accumulated coverage
+typedef  std::map<uint32_t, float>  HashMap;
 
 namespace HA_HDK {
 
@@ -36,19 +45,117 @@ inline auto myPointer(It const&it) -> decltype(std::addressof(*it)) { return std
 enum Automatte_HashType {
     MANTRA,
     CRYPTO,
-    DEEP
+    DEEP   // crypto ids, plus per pixel deep id lists saved to a file.
+};
+
+enum Automatte_SampleSource {
+    NATIVE,   // ids precomposed by mantra: raster or special channels.
+    VEXSTORE  // uncomposited shader samples from vexstoresave().
+};
+
+enum Automatte_OutputMode {
+    PREVIEW,   // rank 0: false colors
+    RANK,      // id/coverage pairs
+    PACKED,    // four pairs per plane, see AutomattesPacked.hpp (-k 1)
+    DIAGNOSTIC // samples, ids, lookups per pixel and bucket's filter time (-d 1)
+};
+
+// accumulated per id inside a pixel (DEEP hash type).
+struct DeepSample
+{
+    float coverage = 0.f;
+    float depth    = FLT_MAX;
+};
+struct DeepEntry
+{
+    uint32_t id;
+    DeepSample sample;
+};
+// flat like IdCoverageArray, sorted by id once the pixel is done.
+typedef std::vector<DeepEntry> DeepPixel;
+
+inline DeepSample & deepSample(DeepPixel & pixel, const uint32_t id)
+{
+    const size_t size = pixel.size();
+    for (size_t i = 0; i < size; ++i) {
+        if (pixel[i].id == id)
+            return pixel[i].sample;
+    }
+    pixel.push_back(DeepEntry{id, DeepSample()});
+    return pixel.back().sample;
+}
+
+// what a subpixel adds to pixels reading it: weight*coverage to the id,
+// weight*norm to pixel's normalization (partial files' band samples).
+struct BandEntry
+{
+    uint32_t id;
+    float coverage;
+    float norm;
+};
+typedef std::vector<BandEntry> BandEntries;
+
+// last output of a tile, reused as long as the tile gets no new samples.
+struct CachedTile
+{
+    uint32_t generation;
+    std::vector<float> pixels;
 };
+typedef tbb::concurrent_hash_map<TileKey, CachedTile> TileCache;
+
+// Progressive passes filter a tile many times: side outputs keep tile's 
+// latest pass only, and are written once the render's filters go away.
+class TileOutputs
+{
+public:
+    TileOutputs(const std::shared_ptr<DeepIdWriter> &, const std::shared_ptr<MatteSidecar> &, 
+        const std::shared_ptr<CoverageCensus> &);
+    ~TileOutputs();
+
+    // replaces tile's outputs, unless they come from a later generation already.
+    void set(const TileKey, const uint32_t, DeepBucket *, const MatteBucket *, 
+        const CensusBucket *);
 
+private:
+    struct Tile
+    {
+        uint32_t     generation = 0;
+        DeepBucket   deep;
+        MatteBucket  matte;
+        CensusBucket census;
+    };
+    tbb::concurrent_hash_map<TileKey, Tile> myTiles;
+    std::shared_ptr<DeepIdWriter>   myDeepWriter;
+    std::shared_ptr<MatteSidecar>   myMatteSidecar;
+    std::shared_ptr<CoverageCensus> myCensus;
+};
 
 enum Automatte_IdType {
-    ASSET, // not supported yet
+    ASSET, // resolved from object ids via IdTables
     OBJECT,
     MATERIAL,
-    GROUP // not supported yet
+    GROUP // resolved from object ids via IdTables
 };
 
-inline float gaussian(float d, float expv, float alpha) {
-    return SYSmax(0.f, float(SYSexp(-alpha*d*d) - expv));
+// Calls fn(id, share) for every id of given type the object id stands for.
+// Objects in many groups are expanded into each of them with full coverage,
+// share splits false colors between them. Returns number of ids.
+template<Automatte_IdType I, typename Fn>
+inline int resolveIds(const uint32_t objid, const IdTables * tables, Fn fn)
+{
+    if (I == ASSET) {
+        fn(tables->asset(objid), 1.f);
+        return 1;
+    } else if (I == GROUP) {
+        GroupMask groups = tables->group(objid);
+        const int count = __builtin_popcountll(groups);
+        const float share = 1.f / SYSmax(count, 1);
+        for (; groups; groups &= groups - 1) 
+            fn(tables->groupHashes[__builtin_ctzll(groups)], share);
+        return count;
+    }
+    fn(objid, 1.f);
+    return 1;
 }
 
 inline float gaussianFilter(float x, float y, float expv, float alpha) {
@@ -56,39 +163,57 @@ inline float gaussianFilter(float x, float y, float expv, float alpha) {
 }
 
 
-// From Cryptomatte specification[1]
-float hash_to_float(uint32_t hash)
-{
-    uint32_t mantissa = hash & (( 1 << 23) - 1);
-    uint32_t exponent = (hash >> 23) & ((1 << 8) - 1);
-    exponent = std::max(exponent, (uint32_t) 1);
-    exponent = std::min(exponent, (uint32_t) 254);
-    exponent = exponent << 23;
-    uint32_t sign = (hash >> 31);
-    sign = sign << 31;
-    uint32_t float_bits = sign | exponent | mantissa;
-    float f;
-    std::memcpy(&f, &float_bits, 4);
-    return f;
-}
-
 // Borrowed from nice people of Mercenaries Engineering
 // https://github.com/MercenariesEngineering/openexrid/\
 // blob/master/nuke/DeepOpenEXRId.cpp
-inline float halton(const float base, const int id)
+inline float halton(const uint32_t base, const uint32_t id)
 {
     float result = 0.f;
     float f = 1.f;
-    float i = static_cast<float>(id);
-    while (i > 0.0f)
+    uint32_t i = id;
+    while (i > 0)
     {
-        f = f / base;
-        result = result + f * std::fmod(i, base);
-        i = std::floor(i / base);
+        f = f / static_cast<float>(base);
+        result = result + f * static_cast<float>(i % base);
+        i = i / base;
     }
     return result;
 }
 
+// Native id channels are floats. Mantra writes Op_Id -1 where nothing was
+// hit, negatives, NaNs and values past uint32_t all become background (0).
+inline uint32_t channel_to_id(const float value)
+{
+    return (value >= 0.f && value < 4294967296.f) ? static_cast<uint32_t>(value) : 0;
+}
+
+// Ids are accumulated as integers; this is the only place they become
+// floats. Asset and group ids are name hashes, bit-encoded per Cryptomatte[1].
+// Object and material ids are Mantra's own integers (shader's getobjectid(),
+// Op_Id), encoding them would give denormals, so they stay plain casts.
+template<Automatte_HashType H, Automatte_IdType I>
+inline float id_to_float(const uint32_t id)
+{
+    return (H != MANTRA && (I == ASSET || I == GROUP)) ? \
+        hash_to_float(id) : static_cast<float>(id);
+}
+
+// preview color of an id (rank 0)
+inline void accumulateFalseColor(float * sample, const uint32_t id, const float weight)
+{
+    // borrowed: https://github.com/MercenariesEngineering/openexrid/blob/master/nuke/DeepOpenEXRId.cpp
+    #ifdef HALTON_FALSE_COLORS
+    sample[0] += weight * halton(2, id);
+    sample[1] += weight * halton(3, id);
+    sample[2] += weight * halton(5, id); 
+    #else
+    uint seed  = id;
+    sample[1] += weight * SYSfastRandom(seed);
+         seed += 2345;
+    sample[2] += weight * SYSfastRandom(seed); 
+    #endif
+}
+
 class VRAY_AutomatteFilter : public VRAY_PixelFilter {
 public:
     VRAY_AutomatteFilter();
@@ -99,6 +224,17 @@ public:
     /// setArgs is called with the options specified after the pixel filter
     /// name in the Pixel Filter parameter on the Mantra ROP.
     /// -i 1 use OpId istead of 'mask' raster
+    /// -h deep -f file.adid saves per pixel deep id lists next to the image.
+    /// -p 1 progressive/IPR: accumulate samples per tile across passes.
+    /// -s name session shared with shaders' vexstoreopen(name).
+    /// -v vex|native filter shader's samples or mantra's own channels.
+    /// -b file.adpt saves crop's id lists and border band for AutomattesMerge.
+    /// -m file.adms saves every id's sparse matte and a manifest (rank planes).
+    /// -c file.json|csv saves visible coverage and bounds per id (rank planes).
+    /// -k 1 packs four id/coverage pairs into rank plane, one per channel.
+    /// -d 1 plane shows filter's cost instead of ids: R stored samples inside of 
+    ///      pixel (subpixels for native), G unique ids, B point grid lookup 
+    ///      expansions (id runs for native), A nanoseconds spent on the bucket.
 
     virtual void setArgs(int argc, const char *const argv[]);
 
@@ -122,6 +258,61 @@ public:
         int destyoffsetinsource,
         const VRAY_Imager &imager) const;
 
+    // Kernels, one instance per mode combination, picked once by setArgs(),
+    // so nothing inside of them branches on modes per subpixel.
+    typedef void (VRAY_AutomatteFilter::*FilterKernel)(
+        float *, int, const VRAY_SampleBuffer &, int, int, int, int, int, 
+        int, int, const VRAY_Imager &) const;
+
+    // filter() for shader's samples stored with vexstoresave().
+    template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+    void filterVex(
+        float *destination,
+        int vectorsize,
+        const VRAY_SampleBuffer &source,
+        int channel,
+        int sourcewidth,
+        int sourceheight,
+        int destwidth,
+        int destheight,
+        int destxoffsetinsource,
+        int destyoffsetinsource,
+        const VRAY_Imager &imager) const;
+
+    // filter() for native channels (ids from the raster or special channels).
+    template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+    void filterNative(
+        float *destination,
+        int vectorsize,
+        const VRAY_SampleBuffer &source,
+        int channel,
+        int sourcewidth,
+        int sourceheight,
+        int destwidth,
+        int destheight,
+        int destxoffsetinsource,
+        int destyoffsetinsource,
+        const VRAY_Imager &imager) const;
+
+    template<Automatte_HashType H, Automatte_IdType I, Automatte_OutputMode O>
+    void writePixel(float *, const int, const float *, 
+        IdCoverageArray &, const float) const;
+    void writeDiagnostic(float *, const int, const int, const int) const;
+    void writeDiagnosticTime(float *, const int, const int, 
+        const std::chrono::steady_clock::time_point &) const;
+
+    // Saves bucket at its origin into partial file, entries(sourcex, sourcey, 
+    // BandEntries&) resolves a subpixel the way the kernel does.
+    template<typename Entries>
+    void writePartial(const int, const int, const int, const int, const int, 
+        const int, Entries) const;
+
+    // Bucket's first pixel in the image, false if nothing in its footprints'
+    // reach is shaded (its pixels have no ids).
+    bool getBucketOrigin(const int &, const int &, 
+        const int &, const int &, const int &,
+        const int &, const float *, const int *, int &, int &) const;
+
     void updateSourceBoundingBox(const int &, const int &, 
         const int &, const int &, 
         const int &, const int &,
@@ -141,7 +332,10 @@ private:
 
     // 0: filtered pseudo color, 
     // 1: for 0-1 ranks, 2: 2-3 and so on...
-    int myRank; 
+    int myRank;
+    int myDiagnostic;   // plane outputs filter's cost
+    int myPacked;       // rank planes hold four pairs
+    int myPlaneKind;    // session's index of planes seeing same ids (-1 none)
     // debug 
     // int myBucketCounter;
 
@@ -153,12 +347,49 @@ private:
 
     int mySortByPz;
 
+    const char* myDeepFileName;  // DEEP hash type output
+    // shared between clones, closed once the last filter goes away.
+    std::shared_ptr<DeepIdWriter> myDeepWriter;
+
+    const char* mySampleSourceName;        // user string flag
+    Automatte_SampleSource mySampleSource; // corresponding enumerator.
+    FilterKernel myKernel;
+    void pickKernel();
+
+    const char* myPartialFileName; // crop split renders
+    // shared between clones, closed once the last filter goes away.
+    std::shared_ptr<DeepIdWriter> myPartialWriter;
+
+    const char* myMatteFileName; // per id sparse mattes
+    // shared between clones, manifest is written once the last filter goes away.
+    std::shared_ptr<MatteSidecar> myMatteSidecar;
+
+    const char* myCensusFileName; // visible coverage report
+    // shared between clones, written once the last filter goes away.
+    std::shared_ptr<CoverageCensus> myCensus;
+
+    int myProgressive;
+    // shared between clones, as passes over a tile may land on any of them.
+    std::shared_ptr<TileCache> myTileCache;
+    std::shared_ptr<TileOutputs> myTileOutputs;
+
+    const char* mySessionName;   // has to match shaders' vexstoreopen()
+    // shared between clones, render's samples live as long as its filters.
+    AutomatteSessionPtr mySession;
+
     // Filter width (default 2)
     float myFilterWidth;
     //  Gaussians parms
     float myGaussianExp;
     float myGaussianAlpha;
 
+    // Filter footprint, the same for every pixel: first subpixel relative to
+    // pixel's first subpixel and separable gaussian weights (set by prepFilter).
+    int myFootOffsetX;
+    int myFootOffsetY;
+    std::vector<float> myWeightsX;
+    std::vector<float> myWeightsY;
+
 
 };
 